@@ -261,7 +261,7 @@
     (define x y w h (get-bldg-pos-&-size k))
 
     ;; random pastel color
-    (set! color (+ 56 (% (random) 16)))
+    (define color (+ 56 (% (random) 16)))
     (fill-rect color x y w h)
 
     ;; windows
@@ -406,21 +406,21 @@
   ;; clear background behind
   (fill-rect COLOR:BG d-x d-y 6 11)
   ;; draw digit
-  (cond
-    (= score 0) (do
+  (case score
+    0 (do
       (line* 0 0 0 10)
       (line* 0 0 5 0)
       (line* 5 0 5 10)
       (line* 0 10 5 10))
-    (= score 1) (do
+    1 (do
       (line* 2 0 2 10))
-    (= score 2) (do
+    2 (do
       (line* 0 0 5 0)
       (line* 5 0 5 5)
       (line* 5 5 0 5)
       (line* 0 5 0 10)
       (line* 0 10 5 10))
-    (= score 3) (do
+    3 (do
       (line* 0 0 5 0)
       (line* 5 0 5 10)
       (line* 0 5 5 5)
@@ -0,0 +1,26 @@
+# Writes a program whose main calls a function that never returns (it has no ret at all):
+#
+#   main:   callfunc 1; ret 1
+#   run:    loop: pushconst 1; pause-frames; drop; jmp loop
+#
+# The VM has to accept it (see `make check`).
+
+import struct
+import sys
+
+OP_PUSHCONST, OP_DROP, OP_CALLFUNC, OP_RET, OP_JMP = 0, 2, 10, 13, 20
+PAUSE_FRAMES = 179
+
+main = bytes([OP_CALLFUNC, 1, OP_RET, 1])
+run = bytes([OP_PUSHCONST]) + struct.pack("<h", 1) + bytes([PAUSE_FRAMES, OP_DROP, OP_JMP])
+# the jump distance counts from the end of the jmp
+run += struct.pack("<h", -(len(run) + 2))
+bytecode = main + run
+
+with open(sys.argv[1], "wb") as f:
+    # header: bytecode length, functions, globals, index of main
+    f.write(struct.pack("<HBBBxxx", len(bytecode), 2, 0, 0))
+    # functions: argc, num-locals, bytecode offset, stack size, call depth (see link.hy)
+    f.write(struct.pack("<BBHHBx", 0, 0, 0, 0, 0))
+    f.write(struct.pack("<BBHHBx", 0, 0, len(main), 0, 0))
+    f.write(bytecode)
@@ -0,0 +1,50 @@
+# Writes a program with code left behind by the REPL, which replaces main every time:
+#
+#   (define (g) 1)          g:      pushconst 1; ret 1
+#   (dotimes (i 3) (g))     (old)   a loop over local 0, calling g; ret 1
+#   (values 1 2)            (old)   pushconst 1; pushconst 2; ret 2
+#   (g)                     main:   callfunc 0; ret 1
+#
+# followed by the tail of a longer main that the last one overwrote. The old mains are not
+# reachable from any entry point, so the VM has to accept the program (see `make check`).
+
+import struct
+import sys
+
+OP_PUSHCONST, OP_ZERO, OP_DROP, OP_GETLOCAL, OP_SETLOCAL = 0, 1, 2, 5, 6
+OP_CALLFUNC, OP_RET, OP_JMP, OP_JGE = 10, 13, 20, 28
+ADD = 128
+
+
+def pushconst(value):
+    return bytes([OP_PUSHCONST]) + struct.pack("<h", value)
+
+
+def jump(opcode, distance):
+    # the distance counts from the end of the jump
+    return bytes([opcode]) + struct.pack("<h", distance)
+
+
+g = pushconst(1) + bytes([OP_RET, 1])
+
+body = bytes([OP_CALLFUNC, 0, OP_DROP, OP_GETLOCAL, 0]) + pushconst(1) + bytes([ADD, OP_SETLOCAL, 0])
+test = bytes([OP_GETLOCAL, 0]) + pushconst(3) + jump(OP_JGE, len(body) + 3)
+loop = test + body
+loop += jump(OP_JMP, -(len(loop) + 3))
+dotimes = bytes([OP_ZERO, OP_SETLOCAL, 0]) + loop + bytes([OP_ZERO, OP_RET, 1])
+
+values = pushconst(1) + pushconst(2) + bytes([OP_RET, 2])
+
+main = bytes([OP_CALLFUNC, 0, OP_RET, 1])
+# starts in the middle of an instruction, and ends with one cut short
+tail = dotimes[4:] + bytes([OP_PUSHCONST])
+
+bytecode = g + dotimes + values + main + tail
+
+with open(sys.argv[1], "wb") as f:
+    # header: bytecode length, functions, globals, index of main
+    f.write(struct.pack("<HBBBxxx", len(bytecode), 2, 0, 1))
+    # functions: argc, num-locals, bytecode offset, stack size, call depth (see link.hy)
+    f.write(struct.pack("<BBHHBx", 0, 0, 0, 0, 0))
+    f.write(struct.pack("<BBHHBx", 0, 0, len(g) + len(dotimes) + len(values), 0, 0))
+    f.write(bytecode)
@@ -0,0 +1,16 @@
+;; main calls a function with an endless loop, which has no ret once the linker has removed the
+;; one that can't be reached; the VM has to accept it (see `make check`)
+
+(define x 0)
+
+(define (run)
+  (while 1
+    (fill-rect COLOR:BLACK x 0 10 10)
+    (set! x (% (+ x 1) W))
+    (fill-rect COLOR:WHITE x 0 10 10)
+    (fill-rect COLOR:BLUE 0 (% x H) 10 10)
+    (fill-rect COLOR:RED (% x H) 0 10 10)
+    (pause-frames 1)))
+
+(define (main)
+  (run))
@@ -2,8 +2,6 @@
 
 #include <stdlib.h>
 
-#define FXP_FRAC_BITS 6
-
 // See https://github.com/mcejp/fixed-point-math/blob/main/sin_cos.cpp
 static const int8_t sin_table[65] = {
     0x00, 0x02, 0x03, 0x05, 0x06, 0x08, 0x09, 0x0b, 0x0c, 0x0e,
@@ -1,3 +1,4 @@
+#include "debug.h"
 #include "listener.h"
 #include "stak-vm.h"
 
@@ -15,7 +16,11 @@
 #endif
 
 extern Module mod;
-extern Thread thr;
+extern Thread threads[];
+extern long exec_budget;
+
+// the debugger only controls the main thread
+static Thread* const thr = &threads[0];
 
 // DEBUGGING PRIMITIVES
 
@@ -25,17 +30,33 @@ enum {
     SEGMENT_GLOB = 2,
 };
 
-static void debug_begin_exec(int func_idx, int nargs) {
+// result of verifying the module after the last change, see debug_verify
+static bool module_ok = true;
+static char module_error[128];
+
+static void debug_verify(void) {
+    module_ok = stak_verify(&mod, module_error, sizeof(module_error));
+}
+
+// returns false if the module failed verification (it is then not executed)
+static bool debug_begin_exec(int func_idx, int nargs) {
+    if (!module_ok || (size_t) func_idx >= mod.num_functions) {
+        fprintf(stderr, "debug: not executing function %d: %s\n", func_idx,
+                module_ok ? "no such function" : module_error);
+        return false;
+    }
+
     // (re-)initialize thread
-    thr.frames_paused = 0;
-    thr.fp = 0;
-    thr.frame = 0;
+    thr->frames_paused = 0;
+    thr->fp = 0;
+    thr->frame = 0;
 
     // enter function
-    thr.state = THREAD_EXECUTING;
-    thr.func_index = func_idx;
-    thr.pc = mod.functions[func_idx].bytecode_offset;
-    thr.sp = mod.functions[func_idx].num_locals;
+    thr->state = THREAD_EXECUTING;
+    thr->func_index = func_idx;
+    thr->pc = mod.functions[func_idx].bytecode_offset;
+    thr->sp = mod.functions[func_idx].num_locals;
+    return true;
 }
 
 static void* debug_get_write_buffer(int segment, size_t offset, size_t nbytes) {
@@ -48,9 +69,17 @@ static void* debug_get_write_buffer(int segment, size_t offset, size_t nbytes) {
         return mod.bytecode + offset;
     }
     else if (segment == SEGMENT_FUNC) {
+        if (mod.num_functions < (offset + nbytes) / sizeof(Func)) {
+            mod.num_functions = (offset + nbytes) / sizeof(Func);
+        }
+
         return ((char*) mod.functions) + offset;
     }
     else if (segment == SEGMENT_GLOB) {
+        if (mod.num_globals < (offset + nbytes) / sizeof(V)) {
+            mod.num_globals = (offset + nbytes) / sizeof(V);
+        }
+
         return ((char*) mod.globals) + offset;
     }
 
@@ -58,10 +87,17 @@ static void* debug_get_write_buffer(int segment, size_t offset, size_t nbytes) {
 }
 
 static void debug_suspend(void) {
+    // threads spawned by the program are stopped for good; the REPL suspends before loading
+    // code and would otherwise end up with a second copy of each after re-running main
+    for (int i = 1; i < MAX_THREADS; i++) {
+        threads[i].frames_paused = 0;
+        threads[i].state = THREAD_TERMINATED;
+    }
+
     // we shouldn't have to clear frames_paused. instead we should probably track
     // different Suspension Reasons in a bit field
-    thr.frames_paused = 0;
-    thr.state = THREAD_SUSPENDED;
+    thr->frames_paused = 0;
+    thr->state = THREAD_SUSPENDED;
 }
 
 // SERIAL PROTOCOL
@@ -72,6 +108,7 @@ enum {
     OP_SUSPEND = 's',
     OP_STATE = 'S',
     OP_WRITE_MEM = 'w',
+    OP_SET_BUDGET = 'b',
 };
 
 // framing state
@@ -110,12 +147,19 @@ struct WriteMemCmd {
     uint16_t nbytes;
 } attribute_packed;
 
+_Packed
+struct SetBudgetCmd {
+    uint8_t opcode;
+    uint32_t budget;    // calls + backward jumps per thread and frame, 0 = unlimited
+} attribute_packed;
+
 static uint8_t state = STATE_INIT;
 static uint8_t fstate = FSTATE_INIT;
 static bool send_state_updates = 0;
 static char buf[32];
 static uint8_t buf_used = 0;
 static uint8_t* write_buffer = NULL;
+static uint8_t write_segment;
 
 static void process_byte(int rc) {
     if (buf_used + 1 >= sizeof(buf)) {
@@ -200,11 +244,26 @@ static void process_byte(int rc) {
                 memcpy(&cmd, buf, sizeof(cmd));
 
                 TR(("debug: BEGIN_EXEC %u %u\n", cmd.func_idx, cmd.nargs));
-                debug_begin_exec(cmd.func_idx, cmd.nargs);
+                bool started = debug_begin_exec(cmd.func_idx, cmd.nargs);
 
                 static const uint8_t reply[] = {OP_BEGIN_EXEC, FRAME_DELIMITER};
                 listener_send(reply, sizeof(reply));
                 send_state_updates = (cmd.state_updates != 0);
+
+                if (!started) {
+                    // don't leave a synchronous REPL waiting for a result that will never come
+                    debug_on_program_completion(thr, 0, NULL);
+                }
+            }
+            else if (buf[0] == OP_SET_BUDGET && buf_used == sizeof(struct SetBudgetCmd)) {
+                struct SetBudgetCmd cmd;
+                memcpy(&cmd, buf, sizeof(cmd));
+
+                TR(("debug: SET_BUDGET %lu\n", (unsigned long) cmd.budget));
+                exec_budget = (long) cmd.budget;
+
+                static const uint8_t reply[] = {OP_SET_BUDGET, FRAME_DELIMITER};
+                listener_send(reply, sizeof(reply));
             }
             else {
                 TR(("debug: unrecognized op %u (%uB)\n", buf[0], buf_used));
@@ -221,6 +280,7 @@ static void process_byte(int rc) {
 
             TR(("debug: WRITE_MEM %u %u %u\n", cmd.segment, cmd.offset, cmd.nbytes));
             write_buffer = (uint8_t*) debug_get_write_buffer(cmd.segment, cmd.offset, cmd.nbytes);
+            write_segment = cmd.segment;
             state = STATE_WRITE_MEM;
             break;
         }
@@ -229,6 +289,20 @@ static void process_byte(int rc) {
 
     case STATE_WRITE_MEM:
         if (rc < 0) {
+            if (write_segment == SEGMENT_BC) {
+                // the bytecode was patched, the executable form must be rebuilt
+                stak_predecode(&mod);
+            }
+
+#ifdef STAK_JIT
+            // native code may depend on anything in the module, except the values of globals
+            stak_jit_reset(&mod);
+#endif
+
+            // A program is loaded in several writes, so the module may well be inconsistent
+            // now. That only matters once something is to be executed.
+            debug_verify();
+
             static const uint8_t reply[] = {OP_WRITE_MEM, FRAME_DELIMITER};
             listener_send(reply, sizeof(reply));
 
@@ -243,8 +317,8 @@ static void process_byte(int rc) {
 }
 
 // callback from stak-vm.c
-void debug_on_program_completion(int retc, V const* retv) {
-    if (send_state_updates) {
+void debug_on_program_completion(Thread const* thread, int retc, V const* retv) {
+    if (send_state_updates && thread == thr) {
         uint8_t reply[3] = {OP_STATE, OP_SUSPEND};
         reply[2] = retc;
         listener_send(reply, sizeof(reply));
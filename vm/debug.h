@@ -2,5 +2,5 @@
 
 #include "stak-vm.h"
 
-void debug_on_program_completion(int retc, V const* retv);
+void debug_on_program_completion(Thread const* thread, int retc, V const* retv);
 void debug_tick(void);
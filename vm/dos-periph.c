@@ -3,6 +3,7 @@
 #include <conio.h>
 #include <dos.h>
 #include <stdio.h>
+#include <string.h>
 
 void keyb_init(void);
 void keyb_shutdown(void);
@@ -72,6 +73,12 @@ int draw_line(Thread* thr, int color, int x1, int y1, int x2, int y2) {
         swap_points(&x1, &y1, &x2, &y2);
     }
 
+    // all pixels lie within [x1, x2] x [min(y1, y2), max(y1, y2)];
+    // reject lines that are entirely off the screen
+    if (x2 < 0 || x1 >= SCRW || max(y1, y2) < 0 || min(y1, y2) >= SCRH) {
+        return 0;
+    }
+
     _asm {
         push ds
         mov ds, fb_segment
@@ -251,6 +258,25 @@ int fill_rect(Thread* thr, int color, int x, int y, int w, int h) {
     return 0;
 }
 
+// fill pixels [x_start, x_end) of row y, clipped to the screen
+static void hline(int y, int x_start, int x_end, int color) {
+    if (y < 0 || y >= SCRH) {
+        return;
+    }
+
+    if (x_start < 0) {
+        x_start = 0;
+    }
+
+    if (x_end > SCRW) {
+        x_end = SCRW;
+    }
+
+    if (x_start < x_end) {
+        _fmemset(&PXL(y, x_start), color, x_end - x_start);
+    }
+}
+
 int fill_triangle(Thread* thr, int color, int x1, int y1, int x2, int y2, int x3, int y3) {
     if (!screen) {
         return -1;
@@ -270,6 +296,13 @@ int fill_triangle(Thread* thr, int color, int x1, int y1, int x2, int y2, int x3
         swap_points(&x3, &y3, &x2, &y2);
     }
 
+    // rows [y1, y3) are filled between X coordinates that lie between those of the vertices,
+    // so reject triangles that are entirely off the screen
+    if (y3 <= 0 || y1 >= SCRH
+            || max(x1, max(x2, x3)) <= 0 || min(x1, min(x2, x3)) >= SCRW) {
+        return 0;
+    }
+
     // see https://mcejp.github.io/2020/11/06/bresenham.html for algorithm derivation
     int E1, E2;
     int X_left = x1;
@@ -289,7 +322,7 @@ int fill_triangle(Thread* thr, int color, int x1, int y1, int x2, int y2, int x3
         E2 = -(y3 - y1) - (x3 - x1);
     }
 
-    for (int Y = y1; Y < y2; Y++) {
+    for (int Y = y1; Y < y2 && Y < SCRH; Y++) {
         if (x2 >= x1) {
             while (E1 < 0) {
                 X_left++;
@@ -316,9 +349,7 @@ int fill_triangle(Thread* thr, int color, int x1, int y1, int x2, int y2, int x3
             }
         }
 
-        for (int xx = min(X_left, X_right); xx < max(X_left, X_right); xx++) {
-            PXL(Y, xx) = color;
-        }
+        hline(Y, min(X_left, X_right), max(X_left, X_right), color);
 
         E1 -= 2 * (x2 - x1);
         E2 -= 2 * (x3 - x1);
@@ -335,7 +366,7 @@ int fill_triangle(Thread* thr, int color, int x1, int y1, int x2, int y2, int x3
         E1 = -(y3 - y2) - (x3 - x2);
     }
 
-    for (int Y = y2; Y < y3; Y++) {
+    for (int Y = y2; Y < y3 && Y < SCRH; Y++) {
         if (x3 >= x2) {
             while (E1 < 0) {
                 X_left++;
@@ -362,9 +393,7 @@ int fill_triangle(Thread* thr, int color, int x1, int y1, int x2, int y2, int x3
             }
         }
 
-        for (int xx = min(X_left, X_right); xx < max(X_left, X_right); xx++) {
-            PXL(Y, xx) = color;
-        }
+        hline(Y, min(X_left, X_right), max(X_left, X_right), color);
 
         E1 -= 2 * (x3 - x2);
         E2 -= 2 * (x3 - x1);
@@ -0,0 +1,376 @@
+#include "fb-periph.h"
+#include "periph.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+uint8_t canvas[CANVAS_H][CANVAS_W];
+
+static int min(int a, int b) {
+    return (a < b) ? a : b;
+}
+
+static int max(int a, int b) {
+    return (a > b) ? a : b;
+}
+
+static void swap_points(int* x1, int* y1, int* x2, int* y2) {
+    int x = *x1;
+    int y = *y1;
+    *x1 = *x2;
+    *y1 = *y2;
+    *x2 = x;
+    *y2 = y;
+}
+
+// fill pixels [x, x + w) of row y, clipped to the canvas
+// (glibc's memset already uses the widest stores available)
+static void hline(int x, int y, int w, uint8_t color) {
+    if (y < 0 || y >= CANVAS_H) {
+        return;
+    }
+
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+
+    if (x + w > CANVAS_W) {
+        w = CANVAS_W - x;
+    }
+
+    if (w > 0) {
+        memset(&canvas[y][x], color, w);
+    }
+}
+
+// Cohen-Sutherland outcodes of a point relative to the canvas
+enum {
+    OUT_LEFT = 1,
+    OUT_RIGHT = 2,
+    OUT_TOP = 4,
+    OUT_BOTTOM = 8,
+};
+
+static int outcode(int x, int y) {
+    return (x < 0 ? OUT_LEFT : 0) | (x >= CANVAS_W ? OUT_RIGHT : 0)
+         | (y < 0 ? OUT_TOP : 0) | (y >= CANVAS_H ? OUT_BOTTOM : 0);
+}
+
+// floor(a / b) for b > 0
+static long long floor_div(long long a, long long b) {
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+// Range of steps s for which c + dir * s lies within [0, limit)
+static void axis_range(int c, int dir, int limit, long long* lo, long long* hi) {
+    if (dir > 0) {
+        *lo = -c;
+        *hi = limit - c;
+    }
+    else {
+        *lo = c - limit + 1;
+        *hi = c + 1;
+    }
+}
+
+// First step t of a run (see draw_run) at which the minor coordinate has advanced k times
+static long long first_step(long long k, int n, int d) {
+    if (k <= 0) {
+        return 0;
+    }
+    else if (d == 0) {
+        return n;
+    }
+
+    return floor_div(2LL * n * k - d, 2LL * d) + 1;
+}
+
+// Draw pixels t = 0 .. n-1 of a line starting at (x, y), taking one step along the major axis
+// per pixel. The minor coordinate advances whenever the error term of the Bresenham variant
+// in draw_line becomes positive, which happens to be after exactly
+//   m_t = max(0, ceil(d * (2t + 1) / 2n) - 1)
+// steps, 0 <= d <= n. That makes it possible to clip the line to the canvas before drawing
+// anything, and then start right at the first visible pixel with the correct error term.
+static void draw_run(int x, int y, bool x_major, int major_dir, int minor_dir, int n, int d,
+                     uint8_t color, bool clip) {
+    long long t_start = 0, t_end = n;
+
+    if (clip) {
+        long long lo, hi;
+
+        // constrain t through the major coordinate...
+        if (x_major) {
+            axis_range(x, major_dir, CANVAS_W, &lo, &hi);
+        }
+        else {
+            axis_range(y, major_dir, CANVAS_H, &lo, &hi);
+        }
+
+        if (lo > t_start) {
+            t_start = lo;
+        }
+
+        if (hi < t_end) {
+            t_end = hi;
+        }
+
+        // ...and through the minor one, which is monotonic in t
+        if (x_major) {
+            axis_range(y, minor_dir, CANVAS_H, &lo, &hi);
+        }
+        else {
+            axis_range(x, minor_dir, CANVAS_W, &lo, &hi);
+        }
+
+        lo = first_step(lo, n, d);
+        hi = first_step(hi, n, d);
+
+        if (lo > t_start) {
+            t_start = lo;
+        }
+
+        if (hi < t_end) {
+            t_end = hi;
+        }
+    }
+
+    if (t_start >= t_end) {
+        return;
+    }
+
+    // state at t_start
+    long long m = (2LL * d * t_start + d + 2LL * n - 1) / (2LL * n) - 1;
+
+    if (m < 0) {
+        m = 0;
+    }
+
+    int err = (int) (3LL * d - 2LL * n + 2LL * d * t_start - 2LL * n * m);
+    int count = (int) (t_end - t_start);
+    int major_step = x_major ? major_dir : major_dir * CANVAS_W;
+    int minor_step = x_major ? minor_dir * CANVAS_W : minor_dir;
+
+    if (x_major) {
+        x += major_dir * (int) t_start;
+        y += minor_dir * (int) m;
+    }
+    else {
+        y += major_dir * (int) t_start;
+        x += minor_dir * (int) m;
+    }
+
+    uint8_t* pixel = &canvas[y][x];
+
+    if (d == 0 && x_major) {
+        // horizontal (major_dir is always positive for X)
+        memset(pixel, color, count);
+    }
+    else if (d == 0) {
+        // vertical
+        for (; count > 0; count--, pixel += major_step) {
+            *pixel = color;
+        }
+    }
+    else if (d == n) {
+        // 45 degrees
+        for (; count > 0; count--, pixel += major_step + minor_step) {
+            *pixel = color;
+        }
+    }
+    else {
+        for (;;) {
+            *pixel = color;
+
+            if (--count == 0) {
+                break;
+            }
+
+            pixel += major_step;
+
+            if (err > 0) {
+                err -= 2 * n;
+                pixel += minor_step;
+            }
+
+            err += 2 * d;
+        }
+    }
+}
+
+int draw_line(Thread* thr, int color, int x1, int y1, int x2, int y2) {
+    color &= 0xff;
+
+    int dx, dy;
+
+    if (x2 < x1) {
+        // TODO: would be better inline
+        swap_points(&x1, &y1, &x2, &y2);
+    }
+
+    // All pixels lie within [x1, x2] x [min(y1, y2), max(y1, y2)]. If that is entirely
+    // off the canvas, there is nothing to do; if it is entirely on it, no clipping is needed.
+    int code1 = outcode(x1, min(y1, y2));
+    int code2 = outcode(x2, max(y1, y2));
+
+    if (code1 & code2) {
+        return 0;
+    }
+
+    bool clip = (code1 | code2) != 0;
+
+    dx = x2 - x1;
+    dy = y2 - y1;
+
+    if (dx == 0 && dy == 0) {
+        return 0;
+    }
+
+    if (y2 >= y1 && dx >= dy) {
+        // right-right-down
+        draw_run(x1, y1, true, 1, 1, dx, dy, color, clip);
+    }
+    else if (y2 < y1 && dx >= -dy) {
+        // right-right-up
+        draw_run(x1, y1 - 1, true, 1, -1, dx, -dy, color, clip);
+    }
+    else if (y2 >= y1 && dx < dy) {
+        // right-down-down
+        draw_run(x1, y1, false, 1, 1, dy, dx, color, clip);
+    }
+    else {
+        // right-up-up
+        draw_run(x1, y1 - 1, false, -1, 1, -dy, dx, color, clip);
+    }
+
+    return 0;
+}
+
+int fill_rect(Thread* thr, int color, int x, int y, int w, int h) {
+    color &= 0xff;
+
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+
+    if (y + h > CANVAS_H) {
+        h = CANVAS_H - y;
+    }
+
+    for (; h > 0; h--, y++) {
+        hline(x, y, w, color);
+    }
+
+    return 0;
+}
+
+// One edge of a triangle, stepped one row at a time. It produces exactly the X coordinates of
+// the original Bresenham-style stepping (https://mcejp.github.io/2020/11/06/bresenham.html), in
+// closed form: for row k of the edge from (x0, y0) to (x1, y1), with dy = y1 - y0 > 0,
+//   X_k = x0 + dir * max(0, ceil(N_k / 2dy)),   N_k = |x1 - x0| * (2k + 1) - dy + (x1 < x0)
+// where dir is the sign of x1 - x0. ceil(N_k / 2dy) is kept as quotient and remainder, so that
+// a row costs O(1) however steep the edge, and the edge can start at any row after clipping.
+typedef struct {
+    int x0, dir;
+    int q, r;                   // N_k = q * denom - r, 0 <= r < denom
+    int q_step, r_step;         // 2 * |x1 - x0| = q_step * denom + r_step
+    int denom;
+} Edge;
+
+static void edge_init(Edge* e, int x0, int y0, int x1, int y1, int Y) {
+    int dy = y1 - y0;
+    int a = abs(x1 - x0);
+    // might not fit in an int if the triangle was clipped far from y0
+    long long n = (long long) a * (2 * (long long) (Y - y0) + 1) - dy + (x1 < x0);
+    long long q;
+
+    e->x0 = x0;
+    e->dir = (x1 < x0) ? -1 : 1;
+    e->denom = 2 * dy;
+
+    // ceil(n / denom), rounding correctly for negative n too
+    q = (n >= 0) ? (n + e->denom - 1) / e->denom : -(-n / e->denom);
+
+    e->q = (int) q;
+    e->r = (int) (q * e->denom - n);
+    e->q_step = 2 * a / e->denom;
+    e->r_step = 2 * a % e->denom;
+}
+
+static int edge_x(Edge const* e) {
+    return e->x0 + e->dir * (e->q > 0 ? e->q : 0);
+}
+
+static void edge_step(Edge* e) {
+    e->q += e->q_step;
+    e->r -= e->r_step;
+
+    if (e->r < 0) {
+        e->r += e->denom;
+        e->q++;
+    }
+}
+
+static void fill_spans(Edge* left, Edge* right, int Y, int Y_end, uint8_t color) {
+    for (; Y < Y_end; Y++) {
+        int X_left = edge_x(left);
+        int X_right = edge_x(right);
+
+        hline(min(X_left, X_right), Y, abs(X_right - X_left), color);
+
+        edge_step(left);
+        edge_step(right);
+    }
+}
+
+int fill_triangle(Thread* thr, int color, int x1, int y1, int x2, int y2, int x3, int y3) {
+    color &= 0xff;
+
+    // reorder vertices so that y1 <= y2 <= y3
+
+    if (y2 < y1) {
+        swap_points(&x2, &y2, &x1, &y1);
+    }
+
+    if (y3 < y1) {
+        swap_points(&x3, &y3, &x1, &y1);
+    }
+
+    if (y3 < y2) {
+        swap_points(&x3, &y3, &x2, &y2);
+    }
+
+    // Rows [y1, y3) are filled, each between two X coordinates that lie between those of
+    // the vertices. Reject triangles that are empty or entirely off the canvas.
+    int x_min = min(x1, min(x2, x3));
+    int x_max = max(x1, max(x2, x3));
+
+    if (y1 == y3 || y3 <= 0 || y1 >= CANVAS_H || x_max <= 0 || x_min >= CANVAS_W) {
+        return 0;
+    }
+
+    // clip to the rows of the canvas
+    int Y = max(y1, 0);
+    int Y_end = min(y3, CANVAS_H);
+
+    Edge left, right;
+    edge_init(&right, x1, y1, x3, y3, Y);
+
+    // upper half
+    if (Y < y2) {
+        int Y_mid = min(y2, Y_end);
+
+        edge_init(&left, x1, y1, x2, y2, Y);
+        fill_spans(&left, &right, Y, Y_mid, color);
+        Y = Y_mid;
+    }
+
+    // lower half
+    if (Y < Y_end) {
+        edge_init(&left, x2, y2, x3, y3, Y);
+        fill_spans(&left, &right, Y, Y_end, color);
+    }
+
+    return 0;
+}
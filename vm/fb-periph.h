@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+enum { CANVAS_W = 320 };
+enum { CANVAS_H = 200 };
+
+// 8-bit canvas in VGA palette indices, as on the real hardware. The drawing builtins in
+// fb-periph.c render into it; the platform backend presents it at the end of each frame.
+extern uint8_t canvas[CANVAS_H][CANVAS_W];
@@ -0,0 +1,152 @@
+#include "fb-present.h"
+#include "fb-periph.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS
+#endif
+
+static int present_w, present_h;
+static int32_t* col_map;        // source column for each destination column
+static int16_t* row_map;        // source row for each destination row
+
+// one canvas row after palette expansion
+static uint32_t expanded_row[CANVAS_W] __attribute__((aligned(32)));
+
+static void expand_row_scalar(uint32_t* out, uint8_t const* in, uint32_t const* palette) {
+    for (int x = 0; x < CANVAS_W; x++) {
+        out[x] = palette[in[x]];
+    }
+}
+
+static void scale_row_scalar(uint32_t* out, uint32_t const* in, int32_t const* map, int w) {
+    for (int x = 0; x < w; x++) {
+        out[x] = in[map[x]];
+    }
+}
+
+#ifdef HAVE_AVX2_KERNELS
+__attribute__((target("avx2")))
+static void expand_row_avx2(uint32_t* out, uint8_t const* in, uint32_t const* palette) {
+    // CANVAS_W is a multiple of 8
+    for (int x = 0; x < CANVAS_W; x += 8) {
+        __m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const*) &in[x]));
+        __m256i pixels = _mm256_i32gather_epi32((int const*) palette, indices, 4);
+        _mm256_storeu_si256((__m256i*) &out[x], pixels);
+    }
+}
+
+__attribute__((target("avx2")))
+static void scale_row_avx2(uint32_t* out, uint32_t const* in, int32_t const* map, int w) {
+    int x = 0;
+
+    for (; x + 8 <= w; x += 8) {
+        __m256i indices = _mm256_loadu_si256((__m256i const*) &map[x]);
+        __m256i pixels = _mm256_i32gather_epi32((int const*) in, indices, 4);
+        _mm256_storeu_si256((__m256i*) &out[x], pixels);
+    }
+
+    for (; x < w; x++) {
+        out[x] = in[map[x]];
+    }
+}
+#endif
+
+static void (*expand_row)(uint32_t* out, uint8_t const* in, uint32_t const* palette)
+        = expand_row_scalar;
+static void (*scale_row)(uint32_t* out, uint32_t const* in, int32_t const* map, int w)
+        = scale_row_scalar;
+
+PresentRect present_fit(int window_w, int window_h, bool integer_scale) {
+    PresentRect rect;
+
+    if (integer_scale) {
+        int scale_x = window_w / CANVAS_W;
+        int scale_y = window_h / CANVAS_H;
+        int scale = (scale_x < scale_y) ? scale_x : scale_y;
+
+        if (scale < 1) {
+            scale = 1;
+        }
+
+        rect.w = CANVAS_W * scale;
+        rect.h = CANVAS_H * scale;
+    }
+    else if (window_w * 3 > window_h * 4) {
+        // wider than 4:3 -> bars on the sides
+        rect.h = window_h;
+        rect.w = window_h * 4 / 3;
+    }
+    else {
+        rect.w = window_w;
+        rect.h = window_w * 3 / 4;
+    }
+
+    // don't go outside a window that is too small
+    if (rect.w > window_w) {
+        rect.w = window_w;
+    }
+
+    if (rect.h > window_h) {
+        rect.h = window_h;
+    }
+
+    rect.x = (window_w - rect.w) / 2;
+    rect.y = (window_h - rect.h) / 2;
+    return rect;
+}
+
+void present_resize(int w, int h) {
+#ifdef HAVE_AVX2_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        expand_row = expand_row_avx2;
+        scale_row = scale_row_avx2;
+    }
+#endif
+
+    col_map = (int32_t*) realloc(col_map, (w > 0 ? w : 1) * sizeof(*col_map));
+    row_map = (int16_t*) realloc(row_map, (h > 0 ? h : 1) * sizeof(*row_map));
+
+    if (!col_map || !row_map) {
+        fprintf(stderr, "present_resize: out of memory\n");
+        exit(-1);
+    }
+
+    // sample at pixel centers
+    for (int x = 0; x < w; x++) {
+        col_map[x] = (int32_t) ((2 * x + 1) * CANVAS_W / (2 * w));
+    }
+
+    for (int y = 0; y < h; y++) {
+        row_map[y] = (int16_t) ((2 * y + 1) * CANVAS_H / (2 * h));
+    }
+
+    present_w = w;
+    present_h = h;
+}
+
+void present_canvas(uint32_t* dst, int pitch, uint32_t const palette[256]) {
+    uint32_t const* prev_out = NULL;
+    int prev_src_y = -1;
+
+    for (int y = 0; y < present_h; y++) {
+        uint32_t* out = (uint32_t*) ((uint8_t*) dst + y * pitch);
+        int src_y = row_map[y];
+
+        if (src_y == prev_src_y) {
+            // rows that repeat a source row are just copied
+            memcpy(out, prev_out, present_w * sizeof(uint32_t));
+        }
+        else {
+            expand_row(expanded_row, canvas[src_y], palette);
+            scale_row(out, expanded_row, col_map, present_w);
+        }
+
+        prev_out = out;
+        prev_src_y = src_y;
+    }
+}
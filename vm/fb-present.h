@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Presentation of the canvas (fb-periph.h) on a 32-bit XRGB destination, such as a window
+// surface. Palette expansion and nearest-neighbour scaling use precomputed row/column maps,
+// and AVX2 kernels where the CPU supports them.
+
+typedef struct {
+    int x, y, w, h;
+} PresentRect;
+
+// Choose where to show the canvas in a window of the given size: either the largest whole
+// multiple of the canvas size, or (`integer_scale` false) the largest 4:3 rectangle, as the
+// 320x200 mode was shown on a 4:3 monitor.
+PresentRect present_fit(int window_w, int window_h, bool integer_scale);
+
+// (Re)build the scaling maps for a w x h destination rectangle.
+void present_resize(int w, int h);
+
+// Expand the canvas through `palette` and scale it into the w x h rectangle at `dst`
+// (pitch in bytes) given by the last present_resize.
+void present_canvas(uint32_t* dst, int pitch, uint32_t const palette[256]);
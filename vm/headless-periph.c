@@ -0,0 +1,225 @@
+// Display-less backend for running STAK programs at full speed, e.g. on a build server.
+// Drawing goes to the in-memory canvas (fb-periph.c) and frames are not throttled.
+//
+// Configured through environment variables:
+//   STAK_FRAMES=n          exit after n frames
+//   STAK_INPUT=file        scripted input; each line is `<frame> <key> down|up`, where <key> is
+//                          one of up, down, left, right, ctrl. Lines starting with # are ignored.
+//   STAK_DUMP=n,m,...      write the canvas at the end of the listed frames (or `all`) as PPM
+//   STAK_DUMP_PREFIX=path  file name prefix for frame dumps (default `frame`)
+
+#include "fb-periph.h"
+#include "periph.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sdl-vga-palette.h"
+
+typedef struct {
+    long frame;
+    int key;
+    bool pressed;
+} InputEvent;
+
+static long frame_number;
+static long max_frames;
+
+static InputEvent* input_events;
+static size_t num_input_events, next_input_event;
+
+static char const* dump_frames;
+static char const* dump_prefix;
+
+static uint16_t keys_curr;
+static uint16_t keys_prev;
+
+static int parse_key(char const* name) {
+    static char const* const names[KEY_MAX] = {
+        [KEY_UP] = "up",
+        [KEY_DOWN] = "down",
+        [KEY_LEFT] = "left",
+        [KEY_RIGHT] = "right",
+        [KEY_CTRL] = "ctrl",
+    };
+
+    for (int key = 0; key < KEY_MAX; key++) {
+        if (strcmp(name, names[key]) == 0) {
+            return key;
+        }
+    }
+
+    return -1;
+}
+
+static void load_input_script(char const* filename) {
+    FILE* f = fopen(filename, "r");
+
+    if (!f) {
+        perror(filename);
+        exit(-1);
+    }
+
+    char line[100];
+    char key_name[20], action[20];
+    long frame;
+    int line_number = 0;
+    size_t capacity = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        line_number++;
+
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0) {
+            continue;
+        }
+
+        int key = -1;
+
+        if (sscanf(line, "%ld %19s %19s", &frame, key_name, action) == 3) {
+            key = parse_key(key_name);
+        }
+
+        if (key < 0 || (strcmp(action, "down") != 0 && strcmp(action, "up") != 0)) {
+            fprintf(stderr, "%s:%d: expected `<frame> <key> down|up`\n", filename, line_number);
+            exit(-1);
+        }
+
+        if (num_input_events > 0 && frame < input_events[num_input_events - 1].frame) {
+            fprintf(stderr, "%s:%d: events must be in order of frames\n", filename, line_number);
+            exit(-1);
+        }
+
+        if (num_input_events == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            input_events = (InputEvent*) realloc(input_events, capacity * sizeof(InputEvent));
+        }
+
+        input_events[num_input_events].frame = frame;
+        input_events[num_input_events].key = key;
+        input_events[num_input_events].pressed = (strcmp(action, "down") == 0);
+        num_input_events++;
+    }
+
+    fclose(f);
+}
+
+static bool should_dump_frame(long frame) {
+    if (!dump_frames) {
+        return false;
+    }
+
+    if (strcmp(dump_frames, "all") == 0) {
+        return true;
+    }
+
+    for (char const* p = dump_frames; *p; ) {
+        char* end;
+        long n = strtol(p, &end, 10);
+
+        if (end == p) {
+            break;
+        }
+
+        if (n == frame) {
+            return true;
+        }
+
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    return false;
+}
+
+static void dump_frame(long frame) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s%05ld.ppm", dump_prefix, frame);
+
+    FILE* f = fopen(filename, "wb");
+
+    if (!f) {
+        perror(filename);
+        return;
+    }
+
+    fprintf(f, "P6\n%d %d\n255\n", CANVAS_W, CANVAS_H);
+
+    for (int y = 0; y < CANVAS_H; y++) {
+        uint8_t row[CANVAS_W * 3];
+
+        for (int x = 0; x < CANVAS_W; x++) {
+            uint32_t rgb = vga_palette[canvas[y][x]];
+            row[x * 3 + 0] = (uint8_t) (rgb >> 16);
+            row[x * 3 + 1] = (uint8_t) (rgb >> 8);
+            row[x * 3 + 2] = (uint8_t) rgb;
+        }
+
+        fwrite(row, 1, sizeof(row), f);
+    }
+
+    fclose(f);
+}
+
+void periph_init(void) {
+    char const* frames = getenv("STAK_FRAMES");
+    char const* input = getenv("STAK_INPUT");
+
+    max_frames = frames ? atol(frames) : 0;
+
+    if (input) {
+        load_input_script(input);
+    }
+
+    dump_frames = getenv("STAK_DUMP");
+    dump_prefix = getenv("STAK_DUMP_PREFIX");
+
+    if (!dump_prefix) {
+        dump_prefix = "frame";
+    }
+}
+
+void periph_shutdown(void) {
+    free(input_events);
+}
+
+static void update_key(int key, bool pressed) {
+    if (pressed) {
+        keys_curr |= (1 << (key));
+    }
+    else {
+        keys_curr &= ~(1 << (key));
+    }
+}
+
+void frame_start(void) {
+    if (max_frames && frame_number >= max_frames) {
+        exit(0);
+    }
+
+    keys_prev = keys_curr;
+
+    while (next_input_event < num_input_events
+            && input_events[next_input_event].frame <= frame_number) {
+        update_key(input_events[next_input_event].key, input_events[next_input_event].pressed);
+        next_input_event++;
+    }
+}
+
+void frame_end(void) {
+    if (should_dump_frame(frame_number)) {
+        dump_frame(frame_number);
+    }
+
+    frame_number++;
+}
+
+int key_held(Thread* thr, int index) {
+    return (keys_curr & (1 << index)) ? 1 : 0;
+}
+
+int key_pressed(Thread* thr, int index) {
+    return (~keys_prev & keys_curr & (1 << index)) ? 1 : 0;
+}
+
+int key_released(Thread* thr, int index) {
+    return (keys_prev & ~keys_curr & (1 << index)) ? 1 : 0;
+}
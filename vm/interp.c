@@ -10,6 +10,10 @@
 #include "listener.h"
 #endif
 
+#ifdef HAVE_PROFILER
+#include "profiler.h"
+#endif
+
 
 typedef struct {
     uint16_t bytecode_length;
@@ -19,23 +23,177 @@ typedef struct {
     uint8_t pad[3];
 } Hdr;
 
+enum {
+    DEBUG_BUDGET = 10000,
+};
+
 Module mod;
-Thread thr;
+Thread threads[MAX_THREADS];    // threads[0] runs main (or whatever the debugger started)
+
+long exec_budget;                // per thread and frame, see stak_exec; 0 = unlimited
+
+// per-frame statistics
+static unsigned long frames_run;
+static unsigned long frames_overrun;    // some thread ran out of budget
+
+// Make sure that t has the memory for a thread starting in the function entry, sized as computed
+// by the linker if possible. The memory is kept after the thread terminates, for the next thread
+// in the same slot.
+static bool thread_reserve(Thread* t, Func const* entry, int default_stack_size) {
+    int stack_size = entry->stack_size ? entry->stack_size : default_stack_size;
+    int max_frames = (entry->stack_size && entry->call_depth < MAX_FRAMES) ? entry->call_depth
+                                                                           : MAX_FRAMES;
+
+    if (t->stack_size < stack_size) {
+        V* stack = realloc(t->stack, stack_size * sizeof(V));
+
+        if (!stack) {
+            return false;
+        }
+
+        t->stack = stack;
+        t->stack_size = stack_size;
+    }
+
+    if (t->max_frames < max_frames) {
+        Frame* frames = realloc(t->frames, max_frames * sizeof(Frame));
+
+        if (!frames) {
+            return false;
+        }
+
+        t->frames = frames;
+        t->max_frames = max_frames;
+    }
+
+    return true;
+}
+
+int stak_spawn(Thread* thr, int func_index) {
+    if (func_index < 0 || (size_t) func_index >= mod.num_functions
+            || mod.functions[func_index].argc != 0) {
+        return -1;
+    }
+
+    for (int i = 1; i < MAX_THREADS; i++) {
+        Thread* t = &threads[i];
+
+        if (t->state != THREAD_TERMINATED) {
+            continue;
+        }
+
+        if (!thread_reserve(t, &mod.functions[func_index], SPAWN_STACK_SIZE)
+                || mod.stack_needed[func_index] > t->stack_size) {
+            return -1;
+        }
+
+        // start on the next frame, as if resuming from (pause-frames 1). this way it does not
+        // matter whether the new thread comes before or after its parent in the round-robin.
+        t->state = THREAD_SUSPENDED;
+        t->frames_paused = 1;
+        t->func_index = func_index;
+        t->pc = mod.functions[func_index].bytecode_offset;
+        t->sp = mod.functions[func_index].num_locals;
+        t->fp = 0;
+        t->frame = 0;
+        return i;
+    }
+
+    return -1;
+}
+
+static bool any_thread_alive(void) {
+    for (int i = 0; i < MAX_THREADS; i++) {
+        if (threads[i].state != THREAD_TERMINATED) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// only the first overrun is reported as it happens, the rest goes into the summary at exit
+static void count_frame(bool overrun) {
+    frames_run++;
+
+    if (overrun && ++frames_overrun == 1) {
+        fprintf(stderr, "frame %lu: ran out of budget (%ld), continuing next frame\n",
+                frames_run, exec_budget);
+    }
+}
+
+static void write_frame_stats(void) {
+    if (frames_overrun) {
+        fprintf(stderr, "%lu of %lu frames ran out of budget\n", frames_overrun, frames_run);
+    }
+}
+
+#ifdef HAVE_PROFILER
+static char const* profile_filename;
+static char const* samples_filename;
+
+// runs at exit, since the program may also end by the window being closed
+static void write_profile(void) {
+    FILE* f = fopen(profile_filename ? profile_filename : samples_filename, "w");
+
+    if (!f) {
+        perror("fopen");
+        return;
+    }
+
+    if (profile_filename) {
+        profile_write_report(f);
+    }
+    else {
+        sampler_write_report(f);
+    }
+
+    fclose(f);
+}
+
+// the linker writes the source map for foo.bc as foo.map
+static char* source_map_filename(char const* filename) {
+    char const* ext = strrchr(filename, '.');
+    size_t base_len = (ext && !strchr(ext, '/')) ? (size_t) (ext - filename) : strlen(filename);
+    char* map_filename = malloc(base_len + 5);
+
+    memcpy(map_filename, filename, base_len);
+    strcpy(map_filename + base_len, ".map");
+    return map_filename;
+}
+#endif
 
 void usage_exit(void) {
-    fprintf(stderr, "usage: stak <filename>\n");
-    fprintf(stderr, "       stak -g\n");
+#ifdef HAVE_PROFILER
+    fprintf(stderr, "usage: stak [-b <budget>] [-p <report.json> | -s <stacks.txt>] <filename>\n");
+#else
+    fprintf(stderr, "usage: stak [-b <budget>] <filename>\n");
+#endif
+    fprintf(stderr, "       stak [-b <budget>] -g\n");
     exit(-1);
 }
 
 int main(int argc, char** argv) {
     char* filename = NULL;
     bool debug_mode = false;
+    bool budget_set = false;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-g") == 0) {
             debug_mode = true;
         }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            exec_budget = atol(argv[++i]);
+            budget_set = true;
+        }
+#ifdef HAVE_PROFILER
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            profile_filename = argv[++i];
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            samples_filename = argv[++i];
+        }
+#endif
         else {
             if (filename) {
                 usage_exit();
@@ -49,17 +207,39 @@ int main(int argc, char** argv) {
         usage_exit();
     }
 
+#ifdef HAVE_PROFILER
+    if (profile_filename && samples_filename) {
+        usage_exit();
+    }
+#endif
+
+    Thread* const thr = &threads[0];
+
     if (debug_mode) {
-        mod.functions = malloc(1024);
+        // code typed into the REPL is more likely to loop forever than a finished program, and
+        // that must not cut off the debug listener
+        if (!budget_set) {
+            exec_budget = DEBUG_BUDGET;
+        }
+
+        // the debugger may start any function, so there are no exact sizes to go by
+        static Func const any_function;
+
+        if (!thread_reserve(thr, &any_function, STACK_SIZE)) {
+            fprintf(stderr, "out of memory\n");
+            return -1;
+        }
+
+        mod.functions = malloc(256 * sizeof(Func));
         mod.globals = malloc(1024);
         mod.bytecode = malloc(16384);
         mod.bytecode_length = 0;
 
         // Start as Terminated, since there is no meaningful func_index or pc (no code is loaded)
-        thr.state = THREAD_TERMINATED;
-        thr.func_index = -1;
-        thr.pc = -1;
-        thr.sp = 0;
+        thr->state = THREAD_TERMINATED;
+        thr->func_index = -1;
+        thr->pc = -1;
+        thr->sp = 0;
     }
     else {
         FILE* f = fopen(filename, "rb");
@@ -76,19 +256,55 @@ int main(int argc, char** argv) {
         fread(buf, 1, sizeof(buf), f);
 
         mod.functions = (Func*) buf;
+        mod.num_functions = h.num_functions;
         mod.globals =   (V*) (buf + h.num_functions * sizeof(Func));
+        mod.num_globals = h.num_globals;
         mod.bytecode =  (uint8_t*) (buf + h.num_functions * sizeof(Func) + h.num_globals * sizeof(V));
         mod.bytecode_length = h.bytecode_length;
 
-        thr.state = THREAD_EXECUTING;
-        thr.func_index = h.main_func_idx;
-        thr.pc = mod.functions[h.main_func_idx].bytecode_offset;
-        thr.sp = mod.functions[h.main_func_idx].argc + mod.functions[h.main_func_idx].num_locals;
+        char error[128];
+
+        if (!stak_verify(&mod, error, sizeof(error))) {
+            fprintf(stderr, "%s: %s\n", filename, error);
+            return -1;
+        }
+
+        if (h.main_func_idx >= h.num_functions) {
+            fprintf(stderr, "%s: no main function\n", filename);
+            return -1;
+        }
+
+        if (!thread_reserve(thr, &mod.functions[h.main_func_idx], STACK_SIZE)) {
+            fprintf(stderr, "out of memory\n");
+            return -1;
+        }
+
+        thr->state = THREAD_EXECUTING;
+        thr->func_index = h.main_func_idx;
+        thr->pc = mod.functions[h.main_func_idx].bytecode_offset;
+        thr->sp = mod.functions[h.main_func_idx].argc + mod.functions[h.main_func_idx].num_locals;
     }
 
-    thr.frames_paused = 0;
-    thr.fp = 0;
-    thr.frame = 0;
+    thr->frames_paused = 0;
+    thr->fp = 0;
+    thr->frame = 0;
+
+#ifdef HAVE_PROFILER
+    // before stak_predecode, which does not fuse instructions while profiling
+    if (profile_filename) {
+        profile_start();
+        atexit(write_profile);
+    }
+    else if (samples_filename) {
+        sampler_start(filename ? source_map_filename(filename) : NULL);
+        atexit(write_profile);
+    }
+#endif
+
+    stak_predecode(&mod);
+#ifdef STAK_JIT
+    stak_jit_reset(&mod);
+#endif
 
 #ifdef HAVE_DEBUG
     if (debug_mode) {
@@ -100,19 +316,35 @@ int main(int argc, char** argv) {
     //atexit(periph_shutdown);
 
     periph_init();
+    atexit(write_frame_stats);
 
-    while (thr.state != THREAD_TERMINATED || debug_mode) {
+    while (any_thread_alive() || debug_mode) {
         frame_start();
 
-        if (thr.frames_paused) {
-            thr.frames_paused--;
+        // wake up everything that is due before running anything, so that a thread spawned
+        // during this frame waits for the next one regardless of its position
+        for (int i = 0; i < MAX_THREADS; i++) {
+            Thread* t = &threads[i];
+
+            if (t->frames_paused) {
+                t->frames_paused--;
+
+                if (t->frames_paused == 0) {
+                    t->state = THREAD_EXECUTING;
+                }
+            }
+        }
+
+        // each thread runs until it pauses, terminates or runs out of budget, in a fixed order
+        bool overrun = false;
 
-            if (thr.frames_paused == 0) {
-                thr.state = THREAD_EXECUTING;
+        for (int i = 0; i < MAX_THREADS; i++) {
+            if (stak_exec(&mod, &threads[i], exec_budget)) {
+                overrun = true;
             }
         }
 
-        stak_exec(&mod, &thr);
+        count_frame(overrun);
 
         frame_end();
 
@@ -11,6 +11,9 @@ enum {
     KEY_MAX
 };
 
+// fractional bits of the fixed-point numbers taken by mul@ and returned by sin@, cos@
+#define FXP_FRAC_BITS 6
+
 void periph_init(void);
 void periph_shutdown(void);
 void frame_start(void);
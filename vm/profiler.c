@@ -0,0 +1,345 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "profiler.h"
+#include "stak-isa.h"
+
+
+enum {
+    // instructions between samples; a prime, so as not to resonate with loops in the program
+    SAMPLE_INTERVAL = 9973,
+    MAX_NAME = 256,
+};
+
+bool profile_enabled;
+Profile profile;
+
+bool sampler_enabled;
+int sample_countdown;
+
+// source map entry; applies from bytecode offset up to the next entry
+typedef struct {
+    unsigned int offset;
+    unsigned int line;
+    char* function;
+    char* file;
+} MapEntry;
+
+static MapEntry* map;
+static size_t map_length;
+
+// distinct (symbolized) stacks, in an open-addressing hash table
+typedef struct {
+    char* stack;
+    uint64_t count;
+} Stack;
+
+static Stack* stacks;
+static size_t num_stacks, stacks_capacity;
+
+typedef struct {
+    uint8_t first, second;
+    uint64_t count;
+} Pair;
+
+#define COMPARE_JUMP_NAME(opcode, operator, name) case opcode: return name;
+
+static char const* opcode_name(int opcode) {
+    switch (opcode) {
+    case OP_PUSHCONST: return "pushconst";
+    case OP_ZERO: return "zero";
+    case OP_DROP: return "drop";
+    case OP_GETGLOBAL: return "getglobal";
+    case OP_SETGLOBAL: return "setglobal";
+    case OP_GETLOCAL: return "getlocal";
+    case OP_SETLOCAL: return "setlocal";
+    case OP_CALLFUNC: return "call/func";
+    case OP_CALL_EXT: return "call/ext";
+    case OP_RET: return "ret";
+    case OP_JMP: return "jmp";
+    case OP_JZ: return "jz";
+    case OP_JNZ: return "jnz";
+    case OP_SWITCH: return "switch";
+    FOR_EACH_COMPARE_JUMP(COMPARE_JUMP_NAME)
+    default: return stak_builtin_name(opcode);
+    }
+}
+
+// Opcodes are reported by name where known, and by number otherwise.
+static void write_opcode_name(FILE* f, int opcode) {
+    char const* name = opcode_name(opcode);
+
+    if (!name) {
+        fprintf(f, "\"op_%02X\"", opcode);
+        return;
+    }
+
+    fputc('"', f);
+
+    for (; *name; name++) {
+        // builtin names are printf format strings (see FOR_EACH_BUILTIN)
+        if (name[0] == '%' && name[1] == '%') {
+            name++;
+        }
+
+        if (*name == '"' || *name == '\\') {
+            fputc('\\', f);
+        }
+
+        fputc(*name, f);
+    }
+
+    fputc('"', f);
+}
+
+static int compare_pairs(void const* a, void const* b) {
+    uint64_t count_a = ((Pair const*) a)->count;
+    uint64_t count_b = ((Pair const*) b)->count;
+
+    return (count_a < count_b) - (count_a > count_b);
+}
+
+void profile_start(void) {
+    profile_enabled = true;
+    profile.prev_opcode = -1;
+}
+
+void profile_write_report(FILE* f) {
+    uint64_t total = 0;
+    bool first;
+
+    for (int op = 0; op < 256; op++) {
+        total += profile.insns[op];
+    }
+
+    fprintf(f, "{\n    \"instructions\": %llu,\n", (unsigned long long) total);
+
+    // bytecode instructions and builtins separately, although they share the opcode space
+    fprintf(f, "    \"opcodes\": {");
+    first = true;
+
+    for (int op = 0; op < 128; op++) {
+        if (profile.insns[op]) {
+            fprintf(f, first ? "\n        " : ",\n        ");
+            write_opcode_name(f, op);
+            fprintf(f, ": %llu", (unsigned long long) profile.insns[op]);
+            first = false;
+        }
+    }
+
+    fprintf(f, "\n    },\n    \"builtins\": {");
+    first = true;
+
+    for (int op = 128; op < 256; op++) {
+        if (profile.insns[op]) {
+            fprintf(f, first ? "\n        " : ",\n        ");
+            write_opcode_name(f, op);
+            fprintf(f, ": %llu", (unsigned long long) profile.insns[op]);
+            first = false;
+        }
+    }
+
+    // function names are not known to the VM, so calls are reported by function index
+    fprintf(f, "\n    },\n    \"calls\": {");
+    first = true;
+
+    for (int i = 0; i < 256; i++) {
+        if (profile.calls[i]) {
+            fprintf(f, "%s\"%d\": %llu", first ? "\n        " : ",\n        ", i,
+                    (unsigned long long) profile.calls[i]);
+            first = false;
+        }
+    }
+
+    // pairs as [first, second, count], most frequent first
+    size_t num_pairs = 0;
+
+    for (int a = 0; a < 256; a++) {
+        for (int b = 0; b < 256; b++) {
+            if (profile.pairs[a][b]) {
+                num_pairs++;
+            }
+        }
+    }
+
+    Pair* pairs = (Pair*) malloc((num_pairs + 1) * sizeof(Pair));
+    num_pairs = 0;
+
+    for (int a = 0; a < 256; a++) {
+        for (int b = 0; b < 256; b++) {
+            if (profile.pairs[a][b]) {
+                pairs[num_pairs].first = a;
+                pairs[num_pairs].second = b;
+                pairs[num_pairs].count = profile.pairs[a][b];
+                num_pairs++;
+            }
+        }
+    }
+
+    qsort(pairs, num_pairs, sizeof(Pair), compare_pairs);
+
+    fprintf(f, "\n    },\n    \"pairs\": [");
+
+    for (size_t i = 0; i < num_pairs; i++) {
+        fprintf(f, i == 0 ? "\n        [" : ",\n        [");
+        write_opcode_name(f, pairs[i].first);
+        fprintf(f, ", ");
+        write_opcode_name(f, pairs[i].second);
+        fprintf(f, ", %llu]", (unsigned long long) pairs[i].count);
+    }
+
+    fprintf(f, "\n    ]\n}\n");
+    free(pairs);
+}
+
+// The source map is a text file with one tab-separated entry per line:
+//   <bytecode offset> <function> <source file> <line>
+// sorted by offset (see link.hy).
+static void load_map(char const* filename) {
+    FILE* f = fopen(filename, "r");
+
+    if (!f) {
+        fprintf(stderr, "warning: no source map %s, samples will not be symbolized\n", filename);
+        return;
+    }
+
+    char buf[3 * MAX_NAME];
+    char function[MAX_NAME], file[MAX_NAME];
+    unsigned int offset, line;
+    size_t capacity = 0;
+
+    while (fgets(buf, sizeof(buf), f)) {
+        if (sscanf(buf, "%u\t%255[^\t]\t%255[^\t]\t%u", &offset, function, file, &line) != 4) {
+            continue;
+        }
+
+        if (map_length == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            map = (MapEntry*) realloc(map, capacity * sizeof(MapEntry));
+        }
+
+        map[map_length].offset = offset;
+        map[map_length].line = line;
+        map[map_length].function = strdup(function);
+        map[map_length].file = strdup(file);
+        map_length++;
+    }
+
+    fclose(f);
+}
+
+static MapEntry const* map_lookup(int pc) {
+    // last entry with offset <= pc
+    size_t lo = 0, hi = map_length;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (map[mid].offset <= (unsigned int) pc) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo > 0 ? &map[lo - 1] : NULL;
+}
+
+static size_t symbolize(char* buf, size_t size, int func_index, int pc) {
+    MapEntry const* entry = map_lookup(pc);
+    int n;
+
+    if (entry) {
+        n = snprintf(buf, size, "%s (%s:%u)", entry->function, entry->file, entry->line);
+    }
+    else {
+        n = snprintf(buf, size, "func#%d+0x%04X", func_index, pc);
+    }
+
+    return n < 0 ? 0 : ((size_t) n < size ? (size_t) n : size - 1);
+}
+
+static uint32_t hash_string(char const* str) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+
+    for (; *str; str++) {
+        hash = (hash ^ (uint8_t) *str) * 16777619u;
+    }
+
+    return hash;
+}
+
+static void count_stack(char const* stack) {
+    if ((num_stacks + 1) * 4 > stacks_capacity * 3) {
+        // grow & rehash
+        size_t old_capacity = stacks_capacity;
+        Stack* old_stacks = stacks;
+
+        stacks_capacity = old_capacity ? old_capacity * 2 : 1024;
+        stacks = (Stack*) calloc(stacks_capacity, sizeof(Stack));
+
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_stacks[i].stack) {
+                size_t j = hash_string(old_stacks[i].stack) & (stacks_capacity - 1);
+
+                while (stacks[j].stack) {
+                    j = (j + 1) & (stacks_capacity - 1);
+                }
+
+                stacks[j] = old_stacks[i];
+            }
+        }
+
+        free(old_stacks);
+    }
+
+    size_t i = hash_string(stack) & (stacks_capacity - 1);
+
+    while (stacks[i].stack && strcmp(stacks[i].stack, stack) != 0) {
+        i = (i + 1) & (stacks_capacity - 1);
+    }
+
+    if (!stacks[i].stack) {
+        stacks[i].stack = strdup(stack);
+        num_stacks++;
+    }
+
+    stacks[i].count++;
+}
+
+void sampler_start(char const* map_filename) {
+    if (map_filename) {
+        load_map(map_filename);
+    }
+
+    sampler_enabled = true;
+    sample_countdown = SAMPLE_INTERVAL;
+}
+
+void sampler_take(Thread const* thr, int func_index, int pc) {
+    // large enough for the longest possible symbol in every frame
+    static char buf[(MAX_FRAMES + 1) * (2 * MAX_NAME + 16)];
+    size_t pos = 0;
+
+    sample_countdown = SAMPLE_INTERVAL;
+
+    // outermost frame first; saved pc points past the call, so look up the call itself
+    for (int i = 0; i < thr->frame; i++) {
+        pos += symbolize(buf + pos, sizeof(buf) - pos, thr->frames[i].func_index,
+                         thr->frames[i].pc - 1);
+        buf[pos++] = ';';
+    }
+
+    symbolize(buf + pos, sizeof(buf) - pos, func_index, pc);
+    count_stack(buf);
+}
+
+void sampler_write_report(FILE* f) {
+    for (size_t i = 0; i < stacks_capacity; i++) {
+        if (stacks[i].stack) {
+            fprintf(f, "%s %llu\n", stacks[i].stack, (unsigned long long) stacks[i].count);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stak-vm.h"
+
+// Execution counters, updated by the profiled interpreter loop (see stak-exec.h)
+typedef struct {
+    uint64_t insns[256];                // by opcode; builtins included
+    uint64_t pairs[256][256];           // by [previous opcode][opcode]
+    uint64_t calls[256];                // by function index
+    int prev_opcode;                    // -1 before the first instruction
+} Profile;
+
+extern bool profile_enabled;
+extern Profile profile;
+
+static inline void profile_insn(int opcode) {
+    profile.insns[opcode]++;
+
+    if (profile.prev_opcode >= 0) {
+        profile.pairs[profile.prev_opcode][opcode]++;
+    }
+
+    profile.prev_opcode = opcode;
+}
+
+void profile_start(void);
+void profile_write_report(FILE* f);
+
+// Sampling profiler. Every SAMPLE_INTERVAL instructions, the sampled interpreter loop records
+// the call stack, which is symbolized using the source map written by the linker (if any).
+extern bool sampler_enabled;
+extern int sample_countdown;
+
+void sampler_start(char const* map_filename);
+void sampler_take(Thread const* thr, int func_index, int pc);
+// write stacks in the "collapsed" format understood by flamegraph.pl & co.
+void sampler_write_report(FILE* f);
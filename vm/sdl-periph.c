@@ -1,3 +1,5 @@
+#include "fb-periph.h"
+#include "fb-present.h"
 #include "periph.h"
 
 #include <SDL.h>
@@ -7,27 +9,18 @@
 static SDL_Window* window;
 static SDL_Surface* screenSurface;
 
-enum { CANVAS_W = 320 };
-enum { CANVAS_H = 200 };
+// window surface for which the present maps were last computed
+static SDL_Surface* presentSurface;
+static int present_surface_w, present_surface_h;
+static PresentRect viewport;
+static bool integer_scale;
+
 enum { WINDOW_W = 640 };
 enum { WINDOW_H = 480 };
 
 static uint16_t keys_curr;
 static uint16_t keys_prev;
 
-static int min(int a, int b) {
-    return (a < b) ? a : b;
-}
-
-static void swap_points(int* x1, int* y1, int* x2, int* y2) {
-    int x = *x1;
-    int y = *y1;
-    *x1 = *x2;
-    *y1 = *y2;
-    *x2 = x;
-    *y2 = y;
-}
-
 void periph_init(void) {
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         fprintf(stderr, "SDL could not initialize: %s\n", SDL_GetError());
@@ -38,7 +31,7 @@ void periph_init(void) {
             "STAK VM",
             SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
             WINDOW_W, WINDOW_H,
-            SDL_WINDOW_SHOWN
+            SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE
             );
 
     if (!window) {
@@ -46,9 +39,14 @@ void periph_init(void) {
         exit(-1);
     }
 
-    // TODO: https://wiki.libsdl.org/SDL2/SDL_SetWindowResizable
+    SDL_SetWindowMinimumSize(window, CANVAS_W, CANVAS_H);
+
+    // STAK_INTEGER_SCALE=1: square pixels at a whole multiple of 320x200 instead of 4:3
+    integer_scale = getenv("STAK_INTEGER_SCALE") && atoi(getenv("STAK_INTEGER_SCALE"));
 
-    // Create an off-screen surface for the canvas
+    // The canvas is rendered at 8 bpp (see fb-periph.c) and normally presented straight into
+    // the window surface (see fb-present.c). This off-screen surface is only used for window
+    // surfaces with an unexpected pixel format, which are left to SDL to convert.
     screenSurface = SDL_CreateRGBSurface(0, CANVAS_W, CANVAS_H, 32, 0, 0, 0, 0);
     if (!screenSurface) {
         fprintf(stderr, "Off-screen surface could not be created: %s\n", SDL_GetError());
@@ -60,226 +58,6 @@ void periph_shutdown(void) {
     SDL_Quit();
 }
 
-static void putpixel(int x, int y, uint8_t color) {
-    SDL_Rect rect = { x, y, 1, 1 };
-    SDL_FillRect(screenSurface, &rect, vga_palette[color]);
-}
-
-int draw_line(Thread* thr, int color, int x1, int y1, int x2, int y2) {
-    if (!screenSurface) {
-        return -1;
-    }
-
-    color &= 0xff;
-
-    int dx, dy, err, x, y;
-
-    if (x2 < x1) {
-        // TODO: would be better inline
-        swap_points(&x1, &y1, &x2, &y2);
-    }
-
-    dx = x2 - x1;
-    dy = y2 - y1;
-
-    if (y2 >= y1 && dx >= dy) {
-        // right-right-down
-        err = 3 * dy - 2 * dx;
-        y = y1;
-
-        for (x = x1; x < x2; x++) {
-            putpixel(x, y, color);
-            if (err > 0) {
-                err -= 2 * dx;
-                y++;
-            }
-            err += 2 * dy;
-        }
-    }
-    else if (y2 < y1 && dx >= -dy) {
-        // right-right-up
-        dy = -dy;
-
-        err = 3 * dy - 2 * dx;
-        y = y1 - 1;
-
-        for (x = x1; x < x2; x++) {
-            putpixel(x, y, color);
-            if (err > 0) {
-                err -= 2 * dx;
-                y--;
-            }
-            err += 2 * dy;
-        }
-    }
-    else if (y2 >= y1 && dx < dy) {
-        // right-down-down
-        err = 3 * dx - 2 * dy;
-        x = x1;
-
-        for (y = y1; y < y2; y++) {
-            putpixel(x, y, color);
-            if (err > 0) {
-                err -= 2 * dy;
-                x++;
-            }
-            err += 2 * dx;
-        }
-    }
-    else if (y2 < y1 && dx < -dy) {
-        // right-up-up
-        dy = -dy;
-
-        err = 3 * dx - 2 * dy;
-        x = x1;
-
-        for (y = y1 - 1; y >= y2; y--) {
-            putpixel(x, y, color);
-            if (err > 0) {
-                err -= 2 * dy;
-                x++;
-            }
-            err += 2 * dx;
-        }
-    }
-
-    return 0;
-}
-
-int fill_rect(Thread* thr, int color, int x, int y, int w, int h) {
-    if (!screenSurface) {
-        return -1;
-    }
-
-    color &= 0xff;
-
-    SDL_Rect rect = { x, y, w, h };
-    SDL_FillRect(screenSurface, &rect, vga_palette[color]);
-    return 0;
-}
-
-int fill_triangle(Thread* thr, int color, int x1, int y1, int x2, int y2, int x3, int y3) {
-    if (!screenSurface) {
-        return -1;
-    }
-
-    color &= 0xff;
-
-    // reorder vertices so that y1 <= y2 <= y3
-
-    if (y2 < y1) {
-        swap_points(&x2, &y2, &x1, &y1);
-    }
-
-    if (y3 < y1) {
-        swap_points(&x3, &y3, &x1, &y1);
-    }
-
-    if (y3 < y2) {
-        swap_points(&x3, &y3, &x2, &y2);
-    }
-
-    // see https://mcejp.github.io/2020/11/06/bresenham.html for algorithm derivation
-    int E1, E2;
-    int X_left = x1;
-    int X_right = x1;
-
-    if (x2 >= x1) {
-        E1 = (y2 - y1) - (x2 - x1);
-    }
-    else {
-        E1 = -(y2 - y1) - (x2 - x1);
-    }
-
-    if (x3 >= x1) {
-        E2 = (y3 - y1) - (x3 - x1);
-    }
-    else {
-        E2 = -(y3 - y1) - (x3 - x1);
-    }
-
-    for (int Y = y1; Y < y2; Y++) {
-        if (x2 >= x1) {
-            while (E1 < 0) {
-                X_left++;
-                E1 += 2 * (y2 - y1);
-            }
-        }
-        else {
-            while (E1 >= 0) {
-                X_left--;
-                E1 -= 2 * (y2 - y1);
-            }
-        }
-
-        if (x3 >= x1) {
-            while (E2 < 0) {
-                X_right++;
-                E2 += 2 * (y3 - y1);
-            }
-        }
-        else {
-            while (E2 >= 0) {
-                X_right--;
-                E2 -= 2 * (y3 - y1);
-            }
-        }
-
-        SDL_Rect rect = { min(X_left, X_right), Y, abs(X_right - X_left), 1 };
-        SDL_FillRect(screenSurface, &rect, vga_palette[color]);
-
-        E1 -= 2 * (x2 - x1);
-        E2 -= 2 * (x3 - x1);
-    }
-
-    // setup for 2nd half
-
-    X_left = x2;
-
-    if (x3 >= x2) {
-        E1 = (y3 - y2) - (x3 - x2);
-    }
-    else {
-        E1 = -(y3 - y2) - (x3 - x2);
-    }
-
-    for (int Y = y2; Y < y3; Y++) {
-        if (x3 >= x2) {
-            while (E1 < 0) {
-                X_left++;
-                E1 += 2 * (y3 - y2);
-            }
-        }
-        else {
-            while (E1 >= 0) {
-                X_left--;
-                E1 -= 2 * (y3 - y2);
-            }
-        }
-
-        if (x3 >= x1) {
-            while (E2 < 0) {
-                X_right++;
-                E2 += 2 * (y3 - y1);
-            }
-        }
-        else {
-            while (E2 >= 0) {
-                X_right--;
-                E2 -= 2 * (y3 - y1);
-            }
-        }
-
-        SDL_Rect rect = { min(X_left, X_right), Y, abs(X_right - X_left), 1 };
-        SDL_FillRect(screenSurface, &rect, vga_palette[color]);
-
-        E1 -= 2 * (x3 - x2);
-        E2 -= 2 * (x3 - x1);
-    }
-
-    return 0;
-}
-
 static void update_key(int key, bool pressed) {
     if (pressed) {
         keys_curr |= (1 << (key));
@@ -318,17 +96,65 @@ void frame_start(void) {
     }
 }
 
+// expand the 8-bit canvas to the 32-bit off-screen surface
+static void expand_canvas(void) {
+    if (SDL_LockSurface(screenSurface) < 0) {
+        return;
+    }
+
+    for (int y = 0; y < CANVAS_H; y++) {
+        uint32_t* row = (uint32_t*) ((uint8_t*) screenSurface->pixels + y * screenSurface->pitch);
+
+        for (int x = 0; x < CANVAS_W; x++) {
+            row[x] = vga_palette[canvas[y][x]];
+        }
+    }
+
+    SDL_UnlockSurface(screenSurface);
+}
+
 void frame_end(void) {
-    if (window && screenSurface) {
-        SDL_Surface* windowSurface = SDL_GetWindowSurface(window);
+    if (!window || !screenSurface) {
+        return;
+    }
 
-        // Scale the off-screen canvas to fill the window
-        SDL_Rect destRect = { 0, 0, WINDOW_W, WINDOW_H };
-        SDL_BlitScaled(screenSurface, NULL, windowSurface, &destRect);
-        SDL_UpdateWindowSurface(window);
+    SDL_Surface* windowSurface = SDL_GetWindowSurface(window);
+
+    if (!windowSurface) {
+        return;
+    }
+
+    if (windowSurface != presentSurface
+            || windowSurface->w != present_surface_w || windowSurface->h != present_surface_h) {
+        // first frame, or the window was resized
+        viewport = present_fit(windowSurface->w, windowSurface->h, integer_scale);
+        present_resize(viewport.w, viewport.h);
+        SDL_FillRect(windowSurface, NULL, 0);
+
+        presentSurface = windowSurface;
+        present_surface_w = windowSurface->w;
+        present_surface_h = windowSurface->h;
+    }
 
-        SDL_Delay(1000 / 60);
+    Uint32 format = windowSurface->format->format;
+
+    if ((format == SDL_PIXELFORMAT_RGB888 || format == SDL_PIXELFORMAT_ARGB8888)
+            && SDL_LockSurface(windowSurface) == 0) {
+        uint32_t* dst = (uint32_t*) ((uint8_t*) windowSurface->pixels
+                + viewport.y * windowSurface->pitch) + viewport.x;
+        present_canvas(dst, windowSurface->pitch, vga_palette);
+        SDL_UnlockSurface(windowSurface);
     }
+    else {
+        expand_canvas();
+
+        SDL_Rect destRect = { viewport.x, viewport.y, viewport.w, viewport.h };
+        SDL_BlitScaled(screenSurface, NULL, windowSurface, &destRect);
+    }
+
+    SDL_UpdateWindowSurface(window);
+
+    SDL_Delay(1000 / 60);
 }
 
 int key_held(Thread* thr, int index) {
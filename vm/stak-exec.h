@@ -0,0 +1,420 @@
+// The interpreter loop. Included by stak-vm.c once for the normal interpreter and, when built
+// with HAVE_PROFILER, once more for each kind of instrumentation, so that the instrumentation
+// costs nothing unless it was requested.
+//
+// Expects EXEC_NAME to be defined (name of the function to generate). The includer may also
+// define EXEC_HOOK_INSN(), run before every instruction, and EXEC_HOOK_CALL(index), run on
+// every call of a bytecode function, and EXEC_JIT to hand over to native code where possible.
+
+#ifndef EXEC_HOOK_INSN
+#define EXEC_HOOK_INSN()
+#endif
+
+#ifndef EXEC_HOOK_CALL
+#define EXEC_HOOK_CALL(index)
+#endif
+
+#ifdef EXEC_JIT
+#define EXEC_JIT_HOT(index) JIT_HOT(index)
+#define EXEC_JIT_ENTER() JIT_ENTER()
+#else
+#define EXEC_JIT_HOT(index)
+#define EXEC_JIT_ENTER()
+#endif
+
+// Go to the target of a jump. Any backward jump may close a loop, so it is where the thread is
+// preempted and the function is found hot.
+#define TAKE_JUMP() do {\
+            op1 = BACKWARD_JUMP();\
+            JUMP();\
+            if (op1) {\
+                PREEMPTION_POINT();\
+                EXEC_JIT_HOT(func - mod->functions);\
+            }\
+            EXEC_JIT_ENTER();\
+        } while (0)
+
+#define COMPARE_JUMP_CASE(opcode, operator, name) CASE(opcode):\
+            sp -= 2;\
+            TR(("  %d " name " %d %+d\n", sp[0], sp[1], VALUE_OPERAND()));\
+            if (sp[0] operator sp[1]) {\
+                TAKE_JUMP();\
+            }\
+            else {\
+                pc += 3;\
+            }\
+            DISPATCH();
+
+bool EXEC_NAME(Module const* mod, Thread* thr, long budget) {
+    Insn const* code = mod->code;
+    V* const stack = thr->stack;
+    V const* const stack_end = stack + thr->stack_size;
+    int op1;
+    V ret_val;
+
+    if (thr->state != THREAD_EXECUTING) {
+        return false;
+    }
+
+    if (budget <= 0) {
+        budget = LONG_MAX;
+    }
+
+    // load interpreter state into registers
+    Func const* func = &mod->functions[thr->func_index];
+    Insn const* pc = code + thr->pc;
+    V* sp = stack + thr->sp;
+    V* fp = stack + thr->fp;
+
+#ifdef EXEC_JIT
+    JitState jit = {thr, stack, stack_end, mod->globals, mod->native};
+
+    // resuming after pause-frames
+    EXEC_JIT_ENTER();
+#endif
+
+#ifdef THREADED_DISPATCH
+#define BUILTIN_LABEL(kind, id, x, name) [id] = &&op_##id,
+#define COMPARE_JUMP_LABEL(opcode, operator, name) [opcode] = &&op_##opcode,
+
+    static void* const dispatch_table[256] = {
+        [0 ... 255] = &&op_invalid,
+        [OP_PUSHCONST] = &&op_OP_PUSHCONST,
+        [OP_ZERO] = &&op_OP_ZERO,
+        [OP_DROP] = &&op_OP_DROP,
+        [OP_GETGLOBAL] = &&op_OP_GETGLOBAL,
+        [OP_SETGLOBAL] = &&op_OP_SETGLOBAL,
+        [OP_GETLOCAL] = &&op_OP_GETLOCAL,
+        [OP_SETLOCAL] = &&op_OP_SETLOCAL,
+        [OP_CALLFUNC] = &&op_OP_CALLFUNC,
+        [OP_RET] = &&op_OP_RET,
+        [OP_JMP] = &&op_OP_JMP,
+        [OP_JZ] = &&op_OP_JZ,
+        [OP_JNZ] = &&op_OP_JNZ,
+        [OP_SWITCH] = &&op_OP_SWITCH,
+#ifdef STAK_PREDECODE
+        [OP_GETLOCAL2] = &&op_OP_GETLOCAL2,
+        [OP_GETLOCAL_PUSHCONST] = &&op_OP_GETLOCAL_PUSHCONST,
+        [OP_GETLOCAL2_ADD] = &&op_OP_GETLOCAL2_ADD,
+        [OP_GETLOCAL2_SUB] = &&op_OP_GETLOCAL2_SUB,
+        [OP_GETLOCAL2_MUL] = &&op_OP_GETLOCAL2_MUL,
+        [OP_GETLOCAL_CONST_ADD] = &&op_OP_GETLOCAL_CONST_ADD,
+        [OP_GETLOCAL_CONST_SUB] = &&op_OP_GETLOCAL_CONST_SUB,
+        [OP_GETLOCAL_CONST_SHR] = &&op_OP_GETLOCAL_CONST_SHR,
+        [OP_INCLOCAL] = &&op_OP_INCLOCAL,
+        [OP_GETGLOBAL_GETLOCAL_MULFXP] = &&op_OP_GETGLOBAL_GETLOCAL_MULFXP,
+        [OP_GETGLOBAL_GETLOCAL_MULFXP_ADD] = &&op_OP_GETGLOBAL_GETLOCAL_MULFXP_ADD,
+        [OP_GETGLOBAL_ADD] = &&op_OP_GETGLOBAL_ADD,
+        [OP_ADD_SETLOCAL] = &&op_OP_ADD_SETLOCAL,
+        [OP_JGE_LOCAL_CONST] = &&op_OP_JGE_LOCAL_CONST,
+        [OP_JGE_LOCAL_LOCAL] = &&op_OP_JGE_LOCAL_LOCAL,
+        [OP_JLT_LOCAL_CONST] = &&op_OP_JLT_LOCAL_CONST,
+        [OP_JLT_LOCAL_LOCAL] = &&op_OP_JLT_LOCAL_LOCAL,
+#endif
+        [OP_PC_OVERFLOW] = &&op_OP_PC_OVERFLOW,
+        FOR_EACH_COMPARE_JUMP(COMPARE_JUMP_LABEL)
+        FOR_EACH_BUILTIN(BUILTIN_LABEL)
+    };
+
+    DISPATCH();
+#else
+    for (;;) {
+        TR(("[%04X] op %02X\tsp=%d\tfp=%d\n", (int) (pc - code), OPCODE(), (int) (sp - stack), (int) (fp - stack)));
+        EXEC_HOOK_INSN();
+
+        switch (OPCODE()) {
+#endif
+        CASE(OP_CALLFUNC):
+            TR(("  call/func %d\n", INDEX_OPERAND()));
+
+            if (thr->frame >= thr->max_frames ||
+                    sp - FUNC_OPERAND()->argc + mod->stack_needed[INDEX_OPERAND()] > stack_end) {
+                fprintf(stderr, "stack overflow\n");
+                exit(-1);
+            }
+
+            // save current pc
+            thr->frames[thr->frame].func_index = func - mod->functions;
+            thr->frames[thr->frame].pc = (pc + 2) - code;
+            thr->frames[thr->frame].fp = fp - stack;
+            thr->frame++;
+            EXEC_HOOK_CALL(INDEX_OPERAND());
+            EXEC_JIT_HOT(INDEX_OPERAND());
+
+            // call function
+            func = FUNC_OPERAND();
+            pc = code + func->bytecode_offset;
+
+            // pop args to locals + allocate space for the rest
+            fp = sp - func->argc;
+            sp += func->num_locals;
+            PREEMPTION_POINT();
+            EXEC_JIT_ENTER();
+            DISPATCH();
+
+#define BUILTIN_CASE(kind, id, x, name) kind(id, x, name)
+
+        FOR_EACH_BUILTIN(BUILTIN_CASE)
+
+        CASE(OP_DROP):
+            TR(("  drop\n"));
+            DROP();
+            pc += 1;
+            DISPATCH();
+
+        CASE(OP_GETGLOBAL):
+            TR(("  getglobal %d\n", INDEX_OPERAND()));
+            PUSH(mod->globals[INDEX_OPERAND()]);
+            pc += 2;
+            DISPATCH();
+
+        CASE(OP_GETLOCAL):
+            TR(("  getlocal %d\t(value=%d)\n", INDEX_OPERAND(), fp[INDEX_OPERAND()]));
+            PUSH(fp[INDEX_OPERAND()]);
+            pc += 2;
+            DISPATCH();
+
+        CASE(OP_JMP):
+            TR(("  jmp %+d\n", VALUE_OPERAND()));
+            TAKE_JUMP();
+            DISPATCH();
+
+        CASE(OP_JZ):
+            TR(("  jz %+d\n", VALUE_OPERAND()));
+            if (POP() == 0) {
+                TAKE_JUMP();
+            }
+            else {
+                pc += 3;
+            }
+            DISPATCH();
+
+        CASE(OP_JNZ):
+            TR(("  jnz %+d\n", VALUE_OPERAND()));
+            if (POP() != 0) {
+                TAKE_JUMP();
+            }
+            else {
+                pc += 3;
+            }
+            DISPATCH();
+
+        FOR_EACH_COMPARE_JUMP(COMPARE_JUMP_CASE)
+
+        CASE(OP_SWITCH):
+            // go straight on through the selected jmp of the table; an index out of range (which
+            // includes any negative one) selects the last
+            op1 = (uint16_t) POP();
+            TR(("  switch %d of %d\n", op1, INDEX_OPERAND()));
+            if (op1 > INDEX_OPERAND()) {
+                op1 = INDEX_OPERAND();
+            }
+            pc += 2 + 3 * op1;
+            TAKE_JUMP();
+            DISPATCH();
+
+        CASE(OP_PUSHCONST):
+            TR(("  pushconst %d\n", VALUE_OPERAND()));
+            PUSH(VALUE_OPERAND());
+            pc += 3;
+            DISPATCH();
+
+        CASE(OP_RET):
+            op1 = INDEX_OPERAND();  // retc
+            TR(("  ret %d\n", op1));
+
+            // TODO: stop abusing ret_val as a temporary, the compiler is not so dumb
+            // at this point: sp == fp + argc + nloc + retc
+            // rightmost:   [sp - 1]    => [sp - nloc - argc - retc + retc - 1]
+            // ...
+            // leftmost:    [sp - retc] => [sp - nloc - argc - retc]
+            sp -= op1;
+            for (ret_val = 0; ret_val < op1; ret_val++) {
+                sp[-func->num_locals - func->argc] = sp[0];
+                sp++;
+            }
+
+            sp = sp - func->num_locals - func->argc;
+
+            if (thr->frame == 0) {
+                TR(("  return from main -> %d value(s) (sp = %d)\n", ret_val, (int) (sp - stack)));
+                pc += 2;
+                thr->state = THREAD_TERMINATED;
+                SAVE_STATE();
+                // a well-formed program should always terminate with sp == ret_val... I think
+                debug_on_program_completion(thr, ret_val, sp - ret_val);
+                return false;
+            }
+
+            // restore fp & pc
+            thr->frame--;
+            fp = stack + thr->frames[thr->frame].fp;
+            pc = code + thr->frames[thr->frame].pc;
+            func = &mod->functions[thr->frames[thr->frame].func_index];
+            EXEC_JIT_ENTER();
+            DISPATCH();
+
+        CASE(OP_SETGLOBAL):
+            TR(("  setglobal %d\n", INDEX_OPERAND()));
+            mod->globals[INDEX_OPERAND()] = POP();
+            pc += 2;
+            DISPATCH();
+
+        CASE(OP_SETLOCAL):
+            TR(("  setlocal %d\t(value=%d)\n", INDEX_OPERAND(), TOP()));
+            fp[INDEX_OPERAND()] = POP();
+            pc += 2;
+            DISPATCH();
+
+        CASE(OP_ZERO):
+            TR(("  zero\n"));
+            PUSH(0);
+            pc += 1;
+            DISPATCH();
+
+#ifdef STAK_PREDECODE
+        CASE(OP_GETLOCAL2):
+            TR(("  getlocal2 %d %d\n", pc->index, pc->index2));
+            PUSH(fp[pc->index]);
+            PUSH(fp[pc->index2]);
+            pc += 4;
+            DISPATCH();
+
+        CASE(OP_GETLOCAL_PUSHCONST):
+            TR(("  getlocal/pushconst %d %d\n", pc->index, pc->value));
+            PUSH(fp[pc->index]);
+            PUSH(pc->value);
+            pc += 5;
+            DISPATCH();
+
+        CASE(OP_GETLOCAL2_ADD):
+            TR(("  getlocal2/+ %d %d\n", pc->index, pc->index2));
+            PUSH(fp[pc->index] + fp[pc->index2]);
+            pc += 5;
+            DISPATCH();
+
+        CASE(OP_GETLOCAL2_SUB):
+            TR(("  getlocal2/- %d %d\n", pc->index, pc->index2));
+            PUSH(fp[pc->index] - fp[pc->index2]);
+            pc += 5;
+            DISPATCH();
+
+        CASE(OP_GETLOCAL2_MUL):
+            TR(("  getlocal2/* %d %d\n", pc->index, pc->index2));
+            PUSH(fp[pc->index] * fp[pc->index2]);
+            pc += 5;
+            DISPATCH();
+
+        CASE(OP_GETLOCAL_CONST_ADD):
+            TR(("  getlocal/+ %d %d\n", pc->index, pc->value));
+            PUSH(fp[pc->index] + pc->value);
+            pc += 6;
+            DISPATCH();
+
+        CASE(OP_GETLOCAL_CONST_SUB):
+            TR(("  getlocal/- %d %d\n", pc->index, pc->value));
+            PUSH(fp[pc->index] - pc->value);
+            pc += 6;
+            DISPATCH();
+
+        CASE(OP_GETLOCAL_CONST_SHR):
+            TR(("  getlocal/>> %d %d\n", pc->index, pc->value));
+            PUSH(fp[pc->index] >> pc->value);
+            pc += 6;
+            DISPATCH();
+
+        CASE(OP_INCLOCAL):
+            TR(("  inclocal %d %d\n", pc->index, pc->value));
+            fp[pc->index] += pc->value;
+            pc += 8;
+            DISPATCH();
+
+        CASE(OP_GETGLOBAL_GETLOCAL_MULFXP):
+            TR(("  getglobal/getlocal/mul@ %d %d\n", pc->index, pc->index2));
+            PUSH(mul_fxp(thr, mod->globals[pc->index], fp[pc->index2]));
+            pc += 5;
+            DISPATCH();
+
+        CASE(OP_GETGLOBAL_GETLOCAL_MULFXP_ADD):
+            TR(("  getglobal/getlocal/mul@/+ %d %d\n", pc->index, pc->index2));
+            TOP() += mul_fxp(thr, mod->globals[pc->index], fp[pc->index2]);
+            pc += 6;
+            DISPATCH();
+
+        CASE(OP_GETGLOBAL_ADD):
+            TR(("  getglobal/+ %d\n", pc->index));
+            TOP() += mod->globals[pc->index];
+            pc += 3;
+            DISPATCH();
+
+        CASE(OP_ADD_SETLOCAL):
+            TR(("  +/setlocal %d\n", pc->index));
+            sp -= 2;
+            fp[pc->index] = sp[0] + sp[1];
+            pc += 3;
+            DISPATCH();
+
+        CASE(OP_JGE_LOCAL_CONST):
+            TR(("  getlocal/jge %d %d\n", pc->index, pc->value));
+            if (fp[pc->index] < pc->value) {
+                pc += 8;
+            }
+            else {
+                TAKE_JUMP();
+            }
+            DISPATCH();
+
+        CASE(OP_JGE_LOCAL_LOCAL):
+            TR(("  getlocal2/jge %d %d\n", pc->index, pc->index2));
+            if (fp[pc->index] < fp[pc->index2]) {
+                pc += 7;
+            }
+            else {
+                TAKE_JUMP();
+            }
+            DISPATCH();
+
+        // the test at the bottom of a loop
+        CASE(OP_JLT_LOCAL_CONST):
+            TR(("  getlocal/jlt %d %d\n", pc->index, pc->value));
+            if (fp[pc->index] < pc->value) {
+                TAKE_JUMP();
+            }
+            else {
+                pc += 8;
+            }
+            DISPATCH();
+
+        CASE(OP_JLT_LOCAL_LOCAL):
+            TR(("  getlocal2/jlt %d %d\n", pc->index, pc->index2));
+            if (fp[pc->index] < fp[pc->index2]) {
+                TAKE_JUMP();
+            }
+            else {
+                pc += 7;
+            }
+            DISPATCH();
+#endif
+
+        CASE(OP_PC_OVERFLOW):
+            fprintf(stderr, "pc overflow\n");
+            exit(-1);
+
+        DEFAULT:
+            printf("  opcode error %d\n", OPCODE());
+            exit(0);
+#ifndef THREADED_DISPATCH
+        }
+    }
+#endif
+}
+
+#undef BUILTIN_LABEL
+#undef BUILTIN_CASE
+#undef COMPARE_JUMP_LABEL
+#undef COMPARE_JUMP_CASE
+#undef EXEC_HOOK_INSN
+#undef EXEC_HOOK_CALL
+#undef EXEC_JIT
+#undef EXEC_JIT_HOT
+#undef EXEC_JIT_ENTER
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 enum {
     OP_PUSHCONST = 0,
     OP_ZERO = 1,
@@ -15,4 +19,157 @@ enum {
 
     OP_JMP = 20,
     OP_JZ = 21,
+    OP_JNZ = 22,
+    // compare the two values on top of the stack and jump if the comparison holds; in the same
+    // order as the comparisons, so that OP_JLT + (opcode - OP_LT) is the one that goes with each
+    OP_JLT = 23,
+    OP_JLE = 24,
+    OP_JEQ = 25,
+    OP_JNE = 26,
+    OP_JGT = 27,
+    OP_JGE = 28,
+    // pop an index and jump through the table that follows: n + 1 jmp instructions, the last of
+    // which is taken for any index outside of 0..n-1
+    OP_SWITCH = 29,
+
+    // builtins that are operators rather than calls into the host (see FOR_EACH_BUILTIN),
+    // for the code that treats them specially
+    OP_ADD = 128,
+    OP_SUB = 129,
+    OP_MUL = 130,
+    OP_DIV = 131,
+    OP_MOD = 132,
+    OP_SHL = 133,
+    OP_SHR = 134,
+    OP_MULFXP = 135,
+    OP_LT = 144,
+    OP_LE = 145,
+    OP_EQ = 146,
+    OP_NE = 147,
+    OP_GT = 148,
+    OP_GE = 149,
+    OP_NOT = 150,
+    OP_AND = 151,
+    OP_OR = 152,
+
+    // Opcodes from 0xE0 up are reserved for the VM's internal representation
+    // and never appear in bytecode files.
+
+    // superinstructions, fused by stak_predecode from common sequences
+    // (a, b: local index; g: global index; k: constant; t: branch target)
+    OP_GETLOCAL2 = 0xE0,                    // getlocal a; getlocal b
+    OP_GETLOCAL_PUSHCONST = 0xE1,           // getlocal a; pushconst k
+    OP_GETLOCAL2_ADD = 0xE2,                // getlocal a; getlocal b; +
+    OP_GETLOCAL2_SUB = 0xE3,                // getlocal a; getlocal b; -
+    OP_GETLOCAL2_MUL = 0xE4,                // getlocal a; getlocal b; *
+    OP_GETLOCAL_CONST_ADD = 0xE5,           // getlocal a; pushconst k; +
+    OP_GETLOCAL_CONST_SUB = 0xE6,           // getlocal a; pushconst k; -
+    OP_GETLOCAL_CONST_SHR = 0xE7,           // getlocal a; pushconst k; >>
+    OP_INCLOCAL = 0xE8,                     // getlocal a; pushconst k; +; setlocal a
+    OP_GETGLOBAL_GETLOCAL_MULFXP = 0xE9,    // getglobal g; getlocal a; mul@
+    OP_GETGLOBAL_GETLOCAL_MULFXP_ADD = 0xEA,// getglobal g; getlocal a; mul@; +
+    OP_GETGLOBAL_ADD = 0xEB,                // getglobal g; +
+    OP_ADD_SETLOCAL = 0xEC,                 // +; setlocal a
+    OP_JGE_LOCAL_CONST = 0xED,              // getlocal a; pushconst k; jge t
+    OP_JGE_LOCAL_LOCAL = 0xEE,              // getlocal a; getlocal b; jge t
+    OP_JLT_LOCAL_CONST = 0xEF,              // getlocal a; pushconst k; jlt t
+    OP_JLT_LOCAL_LOCAL = 0xF0,              // getlocal a; getlocal b; jlt t
+
+    OP_PC_OVERFLOW = 0xFF,  // sentinel past the end of the pre-decoded code
 };
+
+// The compare-and-branch instructions: _(opcode, C operator, mnemonic)
+#define FOR_EACH_COMPARE_JUMP(_) \
+    _(OP_JLT, <, "jlt") \
+    _(OP_JLE, <=, "jle") \
+    _(OP_JEQ, ==, "jeq") \
+    _(OP_JNE, !=, "jne") \
+    _(OP_JGT, >, "jgt") \
+    _(OP_JGE, >=, "jge")
+
+// The built-in library: _(kind, opcode, C function or operator, name in STAK source). Expanded by
+// stak-vm.c into the interpreter's handlers and dispatch table, and by stak2c into C code.
+#define FOR_EACH_BUILTIN(_) \
+    /* math */ \
+    _(BUILTIN_BIN_OP,   128, +, "+") \
+    _(BUILTIN_BIN_OP,   129, -, "-") \
+    _(BUILTIN_BIN_OP,   130, *, "*") \
+    _(BUILTIN_BIN_OP,   131, /, "/") \
+    _(BUILTIN_BIN_OP,   132, %, "%%") \
+    _(BUILTIN_BIN_OP,   133, <<, "<<") \
+    _(BUILTIN_BIN_OP,   134, >>, ">>") \
+    _(BUILTIN_2,        135, mul_fxp, "mul@") \
+    _(BUILTIN_1,        136, sin_fxp, "sin@") \
+    _(BUILTIN_1,        137, cos_fxp, "cos@") \
+    \
+    /* comparison + logic */ \
+    _(BUILTIN_BIN_OP,   144, <, "<") \
+    _(BUILTIN_BIN_OP,   145, <=, "<=") \
+    _(BUILTIN_BIN_OP,   146, ==, "=") \
+    _(BUILTIN_BIN_OP,   147, !=, "!=") \
+    _(BUILTIN_BIN_OP,   148, >, ">") \
+    _(BUILTIN_BIN_OP,   149, >=, ">=") \
+    _(BUILTIN_UNARY_OP, 150, !, "not") \
+    _(BUILTIN_BIN_OP,   151, &&, "and") \
+    _(BUILTIN_BIN_OP,   152, ||, "or") \
+    \
+    /* threads */ \
+    _(BUILTIN_1,        160, stak_spawn, "spawn") \
+    \
+    /* graphics */ \
+    _(BUILTIN_5,        176, draw_line, "draw-line") \
+    _(BUILTIN_5,        177, fill_rect, "fill-rect") \
+    _(BUILTIN_7,        178, fill_triangle, "fill-triangle") \
+    _(BUILTIN_1,        179, pause_frames, "pause-frames") \
+    \
+    /* keyboard */ \
+    _(BUILTIN_1,        192, key_pressed, "key-pressed?") \
+    _(BUILTIN_1,        193, key_released, "key-released?") \
+    _(BUILTIN_1,        194, key_held, "key-held?") \
+    \
+    /* random */ \
+    _(BUILTIN_0,        208, do_random, "random") \
+    _(BUILTIN_1,        209, set_random_seed, "set-random-seed!")
+
+// length of an encoded instruction, including the opcode
+static inline size_t insn_length(uint8_t opcode) {
+    switch (opcode) {
+    case OP_GETGLOBAL:
+    case OP_SETGLOBAL:
+    case OP_GETLOCAL:
+    case OP_SETLOCAL:
+    case OP_RET:
+    case OP_CALLFUNC:
+    case OP_SWITCH:
+        return 2;
+
+    case OP_PUSHCONST:
+    case OP_JMP:
+    case OP_JZ:
+    case OP_JNZ:
+    case OP_JLT:
+    case OP_JLE:
+    case OP_JEQ:
+    case OP_JNE:
+    case OP_JGT:
+    case OP_JGE:
+        return 3;
+
+    default:
+        return 1;
+    }
+}
+
+// jmp, or a conditional jump; all of them have a 16-bit relative target
+static inline bool is_jump(uint8_t opcode) {
+    return opcode >= OP_JMP && opcode <= OP_JGE;
+}
+
+static inline bool is_compare_jump(uint8_t opcode) {
+    return opcode >= OP_JLT && opcode <= OP_JGE;
+}
+
+// number of entries of a switch table, including the default one
+static inline size_t switch_entries(uint8_t const* insn) {
+    return (size_t) insn[1] + 1;
+}
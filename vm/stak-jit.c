@@ -0,0 +1,1274 @@
+// Baseline JIT compiler for x86-64 (System V calling convention)
+//
+// A function is compiled when it has been called, or has jumped backwards, JIT_THRESHOLD times in
+// the interpreter. The native code keeps the VM's own data structures up to date: values that are
+// left on the operand stack at the end of a basic block are stored in the thread's stack, and
+// calls and returns push and pop thr->frames like the interpreter does. Therefore the interpreter
+// can enter native code at the start of any basic block (mod->native), and native code can leave
+// to the interpreter at any instruction. It does so for whatever it doesn't handle itself:
+//
+//  - calls of functions that aren't compiled (yet), or that would overflow the thread's stack
+//  - returns from the function that the thread started in
+//  - running out of budget
+//  - pause-frames suspending the thread, right after the call
+//  - instructions it doesn't know
+//
+// Within a basic block, the top of the operand stack is only simulated at compile time, which turns
+// most of the pushing and popping into register operations (see Entry).
+
+#include "stak-vm.h"
+
+#ifdef STAK_JIT
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "periph.h"
+#include "stak-isa.h"
+
+// #define TR(x) printf x
+#define TR(x)
+
+enum {
+    JIT_THRESHOLD = 100,
+    CODE_SIZE = 4 << 20,
+};
+
+// x86-64 registers
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Registers with a fixed purpose, all callee-saved so that they survive calls of builtins
+enum {
+    FP = RBX,               // V* to the first argument of the current function
+    GLOBALS = R12,          // V*
+    JS = R13,               // JitState*
+    THR = R14,              // Thread*
+    NATIVE = R15,           // mod->native
+};
+
+// registers that hold values of the operand stack, all caller-saved
+static int const value_regs[] = {RAX, RCX, RDX, RSI, RDI, R8, R9, R10, R11};
+enum { NUM_VALUE_REGS = sizeof(value_regs) / sizeof(value_regs[0]) };
+
+// condition codes (low nibble of Jcc/SETcc)
+enum {
+    CC_A = 0x7,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_L = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G = 0xF,
+    CC_ALWAYS = -1,
+};
+
+// operand sizes; S8 marks an instruction on byte registers
+enum { S8, S16, S32, S64 };
+
+static uint8_t* code_start;         // mmap'd, or NULL if there is no JIT; never both writable
+                                    // and executable (see code_writable)
+static uint8_t* code_end;
+static uint8_t* code_free;          // the next instruction is emitted here
+static bool code_overflow;          // code_free reached code_end during the current function
+
+static int (*enter_native)(JitState* js, V* fp, void* entry);
+static uint8_t* exit_native;        // leave native code (eax = pc, edx = function index, rcx = sp)
+
+// CODE EMISSION
+
+// Make the code buffer writable (to emit code into it) or executable (to run it), but not both.
+// Returns false if the protection could not be changed.
+static bool code_writable(bool writable) {
+    if (mprotect(code_start, CODE_SIZE, writable ? (PROT_READ | PROT_WRITE)
+                                                 : (PROT_READ | PROT_EXEC)) != 0) {
+        perror("jit: mprotect");
+        return false;
+    }
+
+    return true;
+}
+
+// Done emitting: without an executable buffer, what is compiled already can't run either
+static void code_executable(void) {
+    if (!code_writable(false)) {
+        exit(-1);
+    }
+}
+
+static void emit(int byte) {
+    if (code_free < code_end) {
+        *code_free++ = (uint8_t) byte;
+    }
+    else {
+        code_overflow = true;
+    }
+}
+
+static void emit16(int value) {
+    emit(value);
+    emit(value >> 8);
+}
+
+static void emit32(int32_t value) {
+    emit16(value);
+    emit16(value >> 16);
+}
+
+static void emit64(uint64_t value) {
+    emit32((int32_t) value);
+    emit32((int32_t) (value >> 32));
+}
+
+static void emit_prefixes(int size, int reg, int index, int rm) {
+    int rex = (size == S64 ? 8 : 0) | (reg >= 8 ? 4 : 0) | (index >= 8 ? 2 : 0) | (rm >= 8 ? 1 : 0);
+
+    if (size == S16) {
+        emit(0x66);
+    }
+
+    // without REX, byte registers 4-7 would be AH, CH, DH, BH
+    if (rex || (size == S8 && ((reg >= 4 && reg < 8) || (rm >= 4 && rm < 8)))) {
+        emit(0x40 | rex);
+    }
+}
+
+static void emit_opcode(int opcode) {
+    if (opcode > 0xFF) {
+        emit(opcode >> 8);
+    }
+
+    emit(opcode);
+}
+
+// opcode with the operands reg (a register or opcode extension) and the register rm
+static void op_rr(int size, int opcode, int reg, int rm) {
+    emit_prefixes(size, reg, -1, rm);
+    emit_opcode(opcode);
+    emit(0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// opcode with the operands reg and memory at [base + index * (1 << scale) + disp]
+static void op_rmx(int size, int opcode, int reg, int base, int index, int scale, int32_t disp) {
+    bool disp8 = (disp >= -128 && disp < 128);
+
+    emit_prefixes(size, reg, index, base);
+    emit_opcode(opcode);
+
+    if (index >= 0 || (base & 7) == RSP) {
+        emit((disp8 ? 0x44 : 0x84) | (reg & 7) << 3);
+        emit(scale << 6 | ((index >= 0 ? index : RSP) & 7) << 3 | (base & 7));
+    }
+    else {
+        emit((disp8 ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+    }
+
+    if (disp8) {
+        emit(disp);
+    }
+    else {
+        emit32(disp);
+    }
+}
+
+static void op_rm(int size, int opcode, int reg, int base, int32_t disp) {
+    op_rmx(size, opcode, reg, base, -1, 0, disp);
+}
+
+static void mov_imm(int reg, int32_t value) {
+    emit_prefixes(S32, 0, -1, reg);
+    emit(0xB8 + (reg & 7));
+    emit32(value);
+}
+
+static void mov_imm64(int reg, uint64_t value) {
+    emit_prefixes(S64, 0, -1, reg);
+    emit(0xB8 + (reg & 7));
+    emit64(value);
+}
+
+static void push_reg(int reg) {
+    emit_prefixes(S32, 0, -1, reg);
+    emit(0x50 + (reg & 7));
+}
+
+static void pop_reg(int reg) {
+    emit_prefixes(S32, 0, -1, reg);
+    emit(0x58 + (reg & 7));
+}
+
+// jump (or Jcc) with a 32-bit displacement; returns where to patch it
+static uint8_t* jump(int cc) {
+    if (cc == CC_ALWAYS) {
+        emit(0xE9);
+    }
+    else {
+        emit(0x0F);
+        emit(0x80 | cc);
+    }
+
+    emit32(0);
+    return code_free - 4;
+}
+
+static void patch(uint8_t* at, uint8_t const* target) {
+    if (!code_overflow) {
+        int32_t rel = (int32_t) (target - (at + 4));
+        memcpy(at, &rel, sizeof(rel));
+    }
+}
+
+// COMPILER STATE
+
+// A value on the simulated operand stack. Values are pushed as constants or references to
+// variables, which are only loaded into registers once they are operated on. Everything is stored
+// to the thread's stack (made a SLOT) by the end of each basic block.
+typedef struct {
+    enum { SLOT, CONST, LOCAL, GLOBAL, REG } kind;
+    int value;                  // CONST: value, LOCAL, GLOBAL: index, REG: register
+} Entry;
+
+// jump to native code that isn't there yet
+typedef struct {
+    uint8_t* at;
+    size_t target;              // offset in function
+    bool absolute;              // the 64-bit address of the target rather than a rel32
+} Fixup;
+
+// exit to the interpreter, emitted after the function body
+typedef struct {
+    uint8_t* at;
+    int pc;
+    int depth;
+    bool restore_budget;        // a unit of budget was taken, but the interpreter is to take it
+} Stub;
+
+enum {
+    INSN_REACHED = 1,
+    INSN_LABEL = 2,             // starts a basic block; native code can be entered here
+};
+
+typedef struct {
+    Module const* mod;
+    size_t index;
+    size_t start;               // bytecode offset of the function
+    int frame_base;             // argc + num_locals: where the operand stack starts
+
+    uint8_t* flags;             // per offset in function
+    uint8_t* depth;
+    uint8_t** labels;           // native code per offset, if it is a label
+
+    Fixup* fixups;
+    size_t num_fixups;
+    Stub* stubs;
+    size_t num_stubs;
+
+    Entry stack[256];
+    int sp;
+    int reg_owner[16];          // stack index held in each register, -1 if none
+} Compiler;
+
+static int32_t slot_disp(Compiler const* c, int index) {
+    return 2 * (c->frame_base + index);
+}
+
+static void exit_to_interpreter(Compiler* c, int cc, int pc, int depth, bool restore_budget) {
+    Stub* stub = &c->stubs[c->num_stubs++];
+    stub->at = jump(cc);
+    stub->pc = pc;
+    stub->depth = depth;
+    stub->restore_budget = restore_budget;
+}
+
+static void jump_to(Compiler* c, int cc, size_t target) {
+    uint8_t* at = jump(cc);
+
+    if (c->labels[target]) {
+        patch(at, c->labels[target]);
+    }
+    else {
+        c->fixups[c->num_fixups].at = at;
+        c->fixups[c->num_fixups].target = target;
+        c->fixups[c->num_fixups].absolute = false;
+        c->num_fixups++;
+    }
+}
+
+// table of native addresses for the entries of a switch, which always come after it
+static void emit_switch_table(Compiler* c, size_t pc, size_t entries) {
+    for (size_t i = 0; i < entries; i++) {
+        c->fixups[c->num_fixups].at = code_free;
+        c->fixups[c->num_fixups].target = pc + 2 + 3 * i;
+        c->fixups[c->num_fixups].absolute = true;
+        c->num_fixups++;
+        emit64(0);
+    }
+}
+
+// SIMULATED OPERAND STACK
+
+static void push(Compiler* c, int kind, int value) {
+    c->stack[c->sp].kind = kind;
+    c->stack[c->sp].value = value;
+    c->sp++;
+}
+
+static void drop(Compiler* c) {
+    Entry const* e = &c->stack[--c->sp];
+
+    if (e->kind == REG) {
+        c->reg_owner[e->value] = -1;
+    }
+}
+
+// memory that holds the value of an entry that is not in a register or a constant
+static void entry_mem(Compiler const* c, int i, int* base, int32_t* disp) {
+    Entry const* e = &c->stack[i];
+
+    switch (e->kind) {
+    case LOCAL:     *base = FP; *disp = 2 * e->value; break;
+    case GLOBAL:    *base = GLOBALS; *disp = 2 * e->value; break;
+    default:        *base = FP; *disp = slot_disp(c, i); break;
+    }
+}
+
+static void spill(Compiler* c, int i) {
+    Entry* e = &c->stack[i];
+
+    op_rm(S16, 0x89, e->value, FP, slot_disp(c, i));               // mov [slot], r16
+    c->reg_owner[e->value] = -1;
+    e->kind = SLOT;
+}
+
+// free the register, if it holds a value
+static void evict(Compiler* c, int reg) {
+    if (c->reg_owner[reg] >= 0) {
+        spill(c, c->reg_owner[reg]);
+    }
+}
+
+// a register that is not in `exclude` (a mask), spilling its value if there is no free one
+static int alloc_reg(Compiler* c, unsigned exclude) {
+    for (int i = 0; i < NUM_VALUE_REGS; i++) {
+        if (c->reg_owner[value_regs[i]] < 0 && !(exclude & 1u << value_regs[i])) {
+            return value_regs[i];
+        }
+    }
+
+    // the value deepest in the stack will be needed last
+    for (int i = 0; i < c->sp; i++) {
+        if (c->stack[i].kind == REG && !(exclude & 1u << c->stack[i].value)) {
+            int reg = c->stack[i].value;
+            spill(c, i);
+            return reg;
+        }
+    }
+
+    // can't happen, there are more registers than any operation needs at once
+    abort();
+}
+
+static unsigned reg_mask(Compiler const* c, int i) {
+    return (c->stack[i].kind == REG) ? 1u << c->stack[i].value : 0;
+}
+
+// load an entry into a register (not in `exclude`); only the low 16 bits are meaningful
+static int to_reg(Compiler* c, int i, unsigned exclude) {
+    Entry* e = &c->stack[i];
+
+    if (e->kind == REG) {
+        return e->value;
+    }
+
+    int reg = alloc_reg(c, exclude);
+
+    if (e->kind == CONST) {
+        mov_imm(reg, e->value);
+    }
+    else {
+        int base;
+        int32_t disp;
+        entry_mem(c, i, &base, &disp);
+        op_rm(S32, 0x0FB7, reg, base, disp);                        // movzx r32, word [mem]
+    }
+
+    e->kind = REG;
+    e->value = reg;
+    c->reg_owner[reg] = i;
+    return reg;
+}
+
+// Store everything to the thread's stack, as expected at the end of a basic block. Only uses
+// MOV, so that flags survive.
+static void flush(Compiler* c) {
+    for (int i = 0; i < c->sp; i++) {
+        if (c->stack[i].kind == REG) {
+            spill(c, i);
+        }
+    }
+
+    for (int i = 0; i < c->sp; i++) {
+        Entry* e = &c->stack[i];
+
+        if (e->kind == CONST) {
+            op_rm(S16, 0xC7, 0, FP, slot_disp(c, i));               // mov word [slot], imm16
+            emit16(e->value);
+        }
+        else if (e->kind != SLOT) {
+            int base;
+            int32_t disp;
+            entry_mem(c, i, &base, &disp);
+            op_rm(S32, 0x0FB7, RAX, base, disp);                    // movzx eax, word [mem]
+            op_rm(S16, 0x89, RAX, FP, slot_disp(c, i));             // mov [slot], ax
+        }
+
+        e->kind = SLOT;
+    }
+}
+
+// start of a basic block: all values are in their slots
+static void reset_stack(Compiler* c, int depth) {
+    c->sp = depth;
+
+    for (int i = 0; i < depth; i++) {
+        c->stack[i].kind = SLOT;
+    }
+
+    for (int i = 0; i < 16; i++) {
+        c->reg_owner[i] = -1;
+    }
+}
+
+// `op r16, entry` for an ALU instruction given by its r16, r/m16 opcode and the /digit of its
+// r/m16, imm16 form
+static void alu16(Compiler* c, int opcode, int ext, int reg, int i) {
+    Entry const* e = &c->stack[i];
+
+    if (e->kind == REG) {
+        op_rr(S16, opcode, reg, e->value);
+    }
+    else if (e->kind == CONST) {
+        if (e->value >= -128 && e->value < 128) {
+            op_rr(S16, 0x83, ext, reg);
+            emit(e->value);
+        }
+        else {
+            op_rr(S16, 0x81, ext, reg);
+            emit16(e->value);
+        }
+    }
+    else {
+        int base;
+        int32_t disp;
+        entry_mem(c, i, &base, &disp);
+        op_rm(S16, opcode, reg, base, disp);
+    }
+}
+
+// a variable is about to be written; copies of its value on the stack must be taken now
+static void before_store(Compiler* c, int kind, int index, unsigned exclude) {
+    for (int i = 0; i < c->sp; i++) {
+        if (c->stack[i].kind == kind && c->stack[i].value == index) {
+            to_reg(c, i, exclude);
+        }
+    }
+}
+
+static void compile_store(Compiler* c, int base, int32_t disp) {
+    int i = c->sp - 1;
+
+    if (c->stack[i].kind == CONST) {
+        op_rm(S16, 0xC7, 0, base, disp);                            // mov word [mem], imm16
+        emit16(c->stack[i].value);
+    }
+    else {
+        op_rm(S16, 0x89, to_reg(c, i, 0), base, disp);              // mov [mem], r16
+    }
+
+    drop(c);
+}
+
+// OPERATIONS
+
+static int condition_code(int opcode) {
+    switch (opcode) {
+    case OP_LT: return CC_L;
+    case OP_LE: return CC_LE;
+    case OP_EQ: return CC_E;
+    case OP_NE: return CC_NE;
+    case OP_GT: return CC_G;
+    case OP_GE: return CC_GE;
+    default:    return -1;
+    }
+}
+
+// result of SETcc as a 0/1 value
+static void setcc(int cc, int reg) {
+    op_rr(S8, 0x0F90 | cc, 0, reg);
+    op_rr(S8, 0x0FB6, reg, reg);                                    // movzx r32, r8
+}
+
+static void compile_binary_op(Compiler* c, int opcode) {
+    int a = c->sp - 2, b = c->sp - 1;
+    int ra, rb;
+
+    switch (opcode) {
+    case OP_ADD:
+        alu16(c, 0x03, 0, to_reg(c, a, reg_mask(c, b)), b);
+        break;
+
+    case OP_SUB:
+        alu16(c, 0x2B, 5, to_reg(c, a, reg_mask(c, b)), b);
+        break;
+
+    case OP_MUL:
+        ra = to_reg(c, a, reg_mask(c, b));
+
+        if (c->stack[b].kind == CONST) {
+            op_rr(S16, 0x69, ra, ra);                               // imul r16, r16, imm16
+            emit16(c->stack[b].value);
+        }
+        else {
+            alu16(c, 0x0FAF, 0, ra, b);
+        }
+        break;
+
+    case OP_DIV:
+    case OP_MOD:
+        // like C on ints: sign-extend and divide in 32 bits; eax / edx are taken by IDIV
+        evict(c, RAX);
+        evict(c, RDX);
+        rb = to_reg(c, b, 1u << RAX | 1u << RDX);
+
+        if (c->stack[a].kind == REG) {
+            op_rr(S32, 0x0FBF, RAX, c->stack[a].value);             // movsx eax, r16
+            c->reg_owner[c->stack[a].value] = -1;
+        }
+        else if (c->stack[a].kind == CONST) {
+            mov_imm(RAX, (V) c->stack[a].value);
+        }
+        else {
+            int base;
+            int32_t disp;
+            entry_mem(c, a, &base, &disp);
+            op_rm(S32, 0x0FBF, RAX, base, disp);                    // movsx eax, word [mem]
+        }
+
+        op_rr(S32, 0x0FBF, rb, rb);                                 // movsx r32, r16
+        emit(0x99);                                                 // cdq
+        op_rr(S32, 0xF7, 7, rb);                                    // idiv r32
+
+        ra = (opcode == OP_DIV) ? RAX : RDX;
+        c->stack[a].kind = REG;
+        c->stack[a].value = ra;
+        c->reg_owner[ra] = a;
+        break;
+
+    case OP_SHL:
+    case OP_SHR:
+        // the shift count is taken mod 32, as by the interpreter on x86
+        if (c->stack[b].kind == CONST) {
+            ra = to_reg(c, a, 0);
+            op_rr(S16, 0xC1, (opcode == OP_SHL) ? 4 : 7, ra);       // shl/sar r16, imm8
+            emit(c->stack[b].value & 31);
+        }
+        else {
+            if (c->stack[b].kind != REG || c->stack[b].value != RCX) {
+                evict(c, RCX);
+                rb = to_reg(c, b, 0);
+                op_rr(S32, 0x89, rb, RCX);                          // mov ecx, r32
+                c->reg_owner[rb] = -1;
+                c->stack[b].kind = REG;
+                c->stack[b].value = RCX;
+                c->reg_owner[RCX] = b;
+            }
+
+            ra = to_reg(c, a, 1u << RCX);
+            op_rr(S16, 0xD3, (opcode == OP_SHL) ? 4 : 7, ra);       // shl/sar r16, cl
+        }
+        break;
+
+    case OP_MULFXP:
+        // as mul_fxp: 32-bit product, scaled back
+        ra = to_reg(c, a, reg_mask(c, b));
+        op_rr(S32, 0x0FBF, ra, ra);                                 // movsx r32, r16
+
+        if (c->stack[b].kind == CONST) {
+            op_rr(S32, 0x69, ra, ra);                               // imul r32, r32, imm32
+            emit32((V) c->stack[b].value);
+        }
+        else {
+            rb = to_reg(c, b, 1u << ra);
+            op_rr(S32, 0x0FBF, rb, rb);                             // movsx r32, r16
+            op_rr(S32, 0x0FAF, ra, rb);                             // imul r32, r32
+        }
+
+        op_rr(S32, 0xC1, 7, ra);                                    // sar r32, imm8
+        emit(FXP_FRAC_BITS);
+        break;
+
+    case OP_AND:
+    case OP_OR:
+        ra = to_reg(c, a, reg_mask(c, b));
+        rb = to_reg(c, b, 1u << ra);
+        op_rr(S16, 0x85, ra, ra);                                   // test r16, r16
+        op_rr(S8, 0x0F90 | CC_NE, 0, ra);                           // setne r8
+        op_rr(S16, 0x85, rb, rb);
+        op_rr(S8, 0x0F90 | CC_NE, 0, rb);
+        op_rr(S8, (opcode == OP_AND) ? 0x22 : 0x0A, ra, rb);        // and/or r8, r8
+        op_rr(S8, 0x0FB6, ra, ra);                                  // movzx r32, r8
+        break;
+
+    default:
+        // comparisons
+        ra = to_reg(c, a, reg_mask(c, b));
+        alu16(c, 0x3B, 7, ra, b);                                   // cmp r16, b
+        setcc(condition_code(opcode), ra);
+        break;
+    }
+
+    drop(c);
+}
+
+// jz (if_zero) or jnz at pc, optionally fused with the comparison before it; a compare-and-branch
+// instruction is a comparison fused with jnz
+static void compile_branch(Compiler* c, int compare_opcode, bool if_zero, size_t pc,
+                           size_t target) {
+    int i = c->sp - 1;
+    int cc = if_zero ? CC_E : CC_NE;
+    bool taken = true;
+
+    if (compare_opcode >= 0) {
+        alu16(c, 0x3B, 7, to_reg(c, i - 1, reg_mask(c, i)), i);     // cmp r16, b
+        cc = condition_code(compare_opcode) ^ if_zero;              // jz: jump if false
+        drop(c);
+    }
+    else if (c->stack[i].kind == CONST) {
+        cc = CC_ALWAYS;
+        taken = ((c->stack[i].value == 0) == if_zero);
+    }
+    else if (c->stack[i].kind == REG) {
+        op_rr(S16, 0x85, c->stack[i].value, c->stack[i].value);     // test r16, r16
+    }
+    else {
+        int base;
+        int32_t disp;
+        entry_mem(c, i, &base, &disp);
+        op_rm(S16, 0x83, 7, base, disp);                            // cmp word [mem], 0
+        emit(0);
+    }
+
+    drop(c);
+    flush(c);
+
+    if (!taken) {
+        return;
+    }
+
+    if (target <= pc) {
+        // takes a unit of budget, as jmp does. Unlike with jmp, the condition is gone by the time
+        // the budget runs out, so the branch is taken and the interpreter preempts at the target.
+        uint8_t* not_taken = (cc != CC_ALWAYS) ? jump(cc ^ 1) : NULL;
+        op_rm(S64, 0xFF, 1, JS, offsetof(JitState, budget));       // dec js->budget
+        exit_to_interpreter(c, CC_E, (int) (c->start + target), c->sp, false);
+        jump_to(c, CC_ALWAYS, target);
+
+        if (not_taken) {
+            patch(not_taken, code_free);
+        }
+    }
+    else {
+        jump_to(c, cc, target);
+    }
+}
+
+static void compile_call(Compiler* c, int pc, size_t callee_index) {
+    Func const* callee = &c->mod->functions[callee_index];
+    int depth = c->sp;
+    int32_t callee_fp = slot_disp(c, depth - callee->argc);
+
+    flush(c);
+
+    // calls that overflow the thread's frames or stack are reported by the interpreter
+    op_rm(S32, 0x8B, RAX, THR, offsetof(Thread, frame));           // mov eax, thr->frame
+    op_rm(S32, 0x3B, RAX, THR, offsetof(Thread, max_frames));      // cmp eax, thr->max_frames
+    exit_to_interpreter(c, CC_GE, pc, depth, false);
+    op_rm(S64, 0x8D, RCX, FP, callee_fp + 2 * c->mod->stack_needed[callee_index]);
+    op_rm(S64, 0x3B, RCX, JS, offsetof(JitState, stack_end));      // cmp rcx, js->stack_end
+    exit_to_interpreter(c, CC_A, pc, depth, false);
+
+    // the interpreter counts calls of functions that are not compiled
+    op_rm(S64, 0x8B, RSI, NATIVE, 8 * callee->bytecode_offset);    // mov rsi, native[callee]
+    op_rr(S64, 0x85, RSI, RSI);                                     // test rsi, rsi
+    exit_to_interpreter(c, CC_E, pc, depth, false);
+
+    op_rm(S64, 0xFF, 1, JS, offsetof(JitState, budget));           // dec js->budget
+    exit_to_interpreter(c, CC_E, pc, depth, true);
+
+    // thr->frames[thr->frame] = {caller, return address, fp}
+    op_rr(S32, 0x69, RDX, RAX);                                     // imul edx, eax, sizeof(Frame)
+    emit32(sizeof(Frame));
+    op_rm(S64, 0x03, RDX, THR, offsetof(Thread, frames));          // add rdx, thr->frames
+    op_rm(S32, 0xC7, 0, RDX, offsetof(Frame, func_index));
+    emit32((int32_t) c->index);
+    op_rm(S32, 0xC7, 0, RDX, offsetof(Frame, pc));
+    emit32(pc + 2);
+    op_rr(S64, 0x89, FP, RCX);                                      // mov rcx, fp
+    op_rm(S64, 0x2B, RCX, JS, offsetof(JitState, stack));          // sub rcx, js->stack
+    op_rr(S64, 0xD1, 7, RCX);                                       // sar rcx, 1
+    op_rm(S32, 0x89, RCX, RDX, offsetof(Frame, fp));
+    op_rr(S32, 0xFF, 0, RAX);                                       // inc eax
+    op_rm(S32, 0x89, RAX, THR, offsetof(Thread, frame));
+
+    op_rm(S64, 0x8D, FP, FP, callee_fp);                            // lea fp, [fp + ...]
+    op_rr(S32, 0xFF, 4, RSI);                                       // jmp rsi
+}
+
+static void compile_ret(Compiler* c, int pc, int retc) {
+    flush(c);
+
+    // the thread terminates; the interpreter takes care of that
+    op_rm(S32, 0x8B, RAX, THR, offsetof(Thread, frame));           // mov eax, thr->frame
+    op_rr(S32, 0x85, RAX, RAX);                                     // test eax, eax
+    exit_to_interpreter(c, CC_E, pc, c->sp, false);
+
+    // the return values replace the arguments
+    for (int i = 0; i < retc && c->frame_base > 0; i++) {
+        op_rm(S32, 0x0FB7, RCX, FP, slot_disp(c, i));               // movzx ecx, word [slot]
+        op_rm(S16, 0x89, RCX, FP, 2 * i);                           // mov [fp + 2 * i], cx
+    }
+
+    op_rm(S64, 0x8D, RCX, FP, 2 * retc);                            // lea rcx, [fp + 2 * retc]
+
+    // pop the frame
+    op_rr(S32, 0xFF, 1, RAX);                                       // dec eax
+    op_rm(S32, 0x89, RAX, THR, offsetof(Thread, frame));
+    op_rr(S32, 0x69, RDX, RAX);                                     // imul edx, eax, sizeof(Frame)
+    emit32(sizeof(Frame));
+    op_rm(S64, 0x03, RDX, THR, offsetof(Thread, frames));          // add rdx, thr->frames
+    op_rm(S32, 0x8B, RSI, RDX, offsetof(Frame, fp));
+    op_rm(S64, 0x8B, FP, JS, offsetof(JitState, stack));
+    op_rmx(S64, 0x8D, FP, FP, RSI, 1, 0);                           // lea fp, [fp + rsi * 2]
+    op_rm(S32, 0x8B, RAX, RDX, offsetof(Frame, pc));
+    op_rm(S32, 0x8B, RDX, RDX, offsetof(Frame, func_index));
+
+    // continue in the caller's native code, or the interpreter if it has none
+    op_rmx(S64, 0x8B, RSI, NATIVE, RAX, 3, 0);                      // mov rsi, native[pc]
+    op_rr(S64, 0x85, RSI, RSI);                                     // test rsi, rsi
+    patch(jump(CC_E), exit_native);
+    op_rr(S32, 0xFF, 4, RSI);                                       // jmp rsi
+}
+
+static void compile_builtin(Compiler* c, int pc, BuiltinFunction function, int argc) {
+    static int const arg_regs[] = {RSI, RDX, RCX, R8, R9};
+    int first = c->sp - argc;
+    int stack_args = (argc > 5) ? (argc - 5 + 1) & ~1 : 0;         // keeps rsp 16-byte aligned
+
+    flush(c);
+
+    op_rr(S64, 0x89, THR, RDI);                                     // mov rdi, thr
+
+    if (stack_args) {
+        op_rr(S64, 0x83, 5, RSP);                                   // sub rsp, imm8
+        emit(8 * stack_args);
+    }
+
+    for (int i = 0; i < argc; i++) {
+        int reg = (i < 5) ? arg_regs[i] : RAX;
+
+        op_rm(S32, 0x0FBF, reg, FP, slot_disp(c, first + i));       // movsx r32, word [slot]
+
+        if (i >= 5) {
+            op_rm(S64, 0x89, RAX, RSP, 8 * (i - 5));                // mov [rsp + ...], rax
+        }
+    }
+
+    mov_imm64(RAX, (uintptr_t) function);
+    op_rr(S32, 0xFF, 2, RAX);                                       // call rax
+
+    if (stack_args) {
+        op_rr(S64, 0x83, 0, RSP);                                   // add rsp, imm8
+        emit(8 * stack_args);
+    }
+
+    while (c->sp > first) {
+        drop(c);
+    }
+
+    // the result is expected in its slot by the interpreter as well as at the label that follows
+    push(c, SLOT, 0);
+    op_rm(S16, 0x89, RAX, FP, slot_disp(c, first));                 // mov [slot], ax
+
+    // pause-frames suspends the thread
+    op_rm(S32, 0x83, 7, THR, offsetof(Thread, state));             // cmp thr->state, imm8
+    emit(THREAD_EXECUTING);
+    exit_to_interpreter(c, CC_NE, pc + 1, c->sp, false);
+}
+
+// ANALYSIS
+
+// Find the reachable instructions of a function and their stack depth, and the labels. Returns
+// the offset just past the last reachable instruction.
+static size_t analyze(Compiler* c, size_t* work) {
+    uint8_t const* bc = c->mod->bytecode + c->start;
+    size_t num_work = 0;
+    size_t end = 0;
+
+    c->flags[0] = INSN_REACHED | INSN_LABEL;
+    c->depth[0] = 0;
+    work[num_work++] = 0;
+
+    while (num_work) {
+        size_t pc = work[--num_work];
+        size_t next = pc + insn_length(bc[pc]);
+        int d = c->depth[pc];
+        bool falls_through = true;
+        long target = -1;
+
+        if (next > end) {
+            end = next;
+        }
+
+        switch (bc[pc]) {
+        case OP_PUSHCONST:
+        case OP_ZERO:
+        case OP_GETGLOBAL:
+        case OP_GETLOCAL:
+            d++;
+            break;
+
+        case OP_DROP:
+        case OP_SETGLOBAL:
+        case OP_SETLOCAL:
+            d--;
+            break;
+
+        case OP_CALLFUNC:
+            if (c->mod->retc[bc[pc + 1]] == NO_RETURN) {
+                falls_through = false;
+            }
+
+            d += c->mod->retc[bc[pc + 1]] - c->mod->functions[bc[pc + 1]].argc;
+            c->flags[next] |= INSN_LABEL;
+            break;
+
+        case OP_RET:
+            falls_through = false;
+            break;
+
+        case OP_JMP:
+            falls_through = false;
+            target = (long) next + (int16_t) (bc[pc + 1] | bc[pc + 2] << 8);
+            break;
+
+        case OP_JZ:
+        case OP_JNZ:
+            d--;
+            target = (long) next + (int16_t) (bc[pc + 1] | bc[pc + 2] << 8);
+            break;
+
+        case OP_JLT:
+        case OP_JLE:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JGT:
+        case OP_JGE:
+            d -= 2;
+            target = (long) next + (int16_t) (bc[pc + 1] | bc[pc + 2] << 8);
+            break;
+
+        case OP_SWITCH:
+            // every entry of the table can be jumped to; the first one is also the next insn
+            d--;
+            c->flags[next] |= INSN_LABEL;
+
+            for (size_t i = 1; i < switch_entries(&bc[pc]); i++) {
+                size_t entry = pc + 2 + 3 * i;
+                c->flags[entry] |= INSN_LABEL;
+
+                if (!(c->flags[entry] & INSN_REACHED)) {
+                    c->flags[entry] |= INSN_REACHED;
+                    c->depth[entry] = d;
+                    work[num_work++] = entry;
+                }
+            }
+            break;
+
+        default:
+            if (stak_builtin_argc(bc[pc]) < 0) {
+                // unknown to the JIT, left to the interpreter
+                falls_through = false;
+                break;
+            }
+
+            d += 1 - stak_builtin_argc(bc[pc]);
+
+            // a call into the host may suspend the thread, which is then resumed here
+            // (mul@ is the one builtin with a C function that is compiled inline)
+            if (bc[pc] != OP_MULFXP && stak_builtin_function(bc[pc])) {
+                c->flags[next] |= INSN_LABEL;
+            }
+        }
+
+        if (target >= 0) {
+            c->flags[target] |= INSN_LABEL;
+
+            if (!(c->flags[target] & INSN_REACHED)) {
+                c->flags[target] |= INSN_REACHED;
+                c->depth[target] = d;
+                work[num_work++] = target;
+            }
+        }
+
+        if (falls_through && !(c->flags[next] & INSN_REACHED)) {
+            c->flags[next] |= INSN_REACHED;
+            c->depth[next] = d;
+            work[num_work++] = next;
+        }
+    }
+
+    return end;
+}
+
+// COMPILATION
+
+static bool is_comparison(int opcode) {
+    return condition_code(opcode) >= 0;
+}
+
+static void compile_function(Compiler* c, size_t end) {
+    uint8_t const* bc = c->mod->bytecode + c->start;
+    bool live = false;              // false after an unconditional jump, until the next label
+
+    for (size_t pc = 0; pc < end; pc += insn_length(bc[pc])) {
+        int opcode = bc[pc];
+        int abs_pc = (int) (c->start + pc);
+
+        // whatever precedes unreachable code does not fall through, so `live` is false
+        if (!(c->flags[pc] & INSN_REACHED)) {
+            continue;
+        }
+
+        if (c->flags[pc] & INSN_LABEL) {
+            if (live) {
+                flush(c);
+            }
+
+            reset_stack(c, c->depth[pc]);
+            c->labels[pc] = code_free;
+            live = true;
+        }
+
+        if (!live) {
+            continue;
+        }
+
+        size_t next = pc + insn_length(opcode);
+        size_t target = 0;
+
+        if (is_jump(opcode)) {
+            target = next + (int16_t) (bc[pc + 1] | bc[pc + 2] << 8);
+        }
+
+        switch (opcode) {
+        case OP_PUSHCONST:
+            push(c, CONST, (V) (bc[pc + 1] | bc[pc + 2] << 8));
+            break;
+
+        case OP_ZERO:
+            push(c, CONST, 0);
+            break;
+
+        case OP_DROP:
+            drop(c);
+            break;
+
+        case OP_GETGLOBAL:
+            push(c, GLOBAL, bc[pc + 1]);
+            break;
+
+        case OP_GETLOCAL:
+            push(c, LOCAL, bc[pc + 1]);
+            break;
+
+        case OP_SETGLOBAL:
+            before_store(c, GLOBAL, bc[pc + 1], reg_mask(c, c->sp - 1));
+            compile_store(c, GLOBALS, 2 * bc[pc + 1]);
+            break;
+
+        case OP_SETLOCAL:
+            before_store(c, LOCAL, bc[pc + 1], reg_mask(c, c->sp - 1));
+            compile_store(c, FP, 2 * bc[pc + 1]);
+            break;
+
+        case OP_CALLFUNC:
+            compile_call(c, abs_pc, bc[pc + 1]);
+            live = false;
+            break;
+
+        case OP_RET:
+            compile_ret(c, abs_pc, bc[pc + 1]);
+            live = false;
+            break;
+
+        case OP_JMP:
+            flush(c);
+
+            if (target <= pc) {
+                op_rm(S64, 0xFF, 1, JS, offsetof(JitState, budget));   // dec js->budget
+                exit_to_interpreter(c, CC_E, abs_pc, c->sp, true);
+            }
+
+            if (target != next) {
+                jump_to(c, CC_ALWAYS, target);
+            }
+            live = false;
+            break;
+
+        case OP_JZ:
+        case OP_JNZ:
+            compile_branch(c, -1, opcode == OP_JZ, pc, target);
+            break;
+
+        case OP_JLT:
+        case OP_JLE:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JGT:
+        case OP_JGE:
+            compile_branch(c, OP_LT + (opcode - OP_JLT), false, pc, target);
+            break;
+
+        case OP_SWITCH: {
+            // the index, clamped to the last entry, picks the native code of one of the jmps that
+            // follow from a table of addresses placed right after the indirect jump
+            uint8_t* table_ref;
+
+            flush(c);
+            op_rm(S32, 0x0FB7, RAX, FP, slot_disp(c, c->sp - 1));       // movzx eax, word [slot]
+            drop(c);
+            mov_imm(RCX, bc[pc + 1]);
+            op_rr(S32, 0x3B, RAX, RCX);                                 // cmp eax, ecx
+            op_rr(S32, 0x0F47, RAX, RCX);                               // cmova eax, ecx
+            emit(0x48);                                                 // lea rcx, [rip + table]
+            emit(0x8D);
+            emit(0x0D);
+            table_ref = code_free;
+            emit32(0);
+            op_rmx(S64, 0xFF, 4, RCX, RAX, 3, 0);                       // jmp [rcx + rax * 8]
+            patch(table_ref, code_free);
+            emit_switch_table(c, pc, switch_entries(&bc[pc]));
+            live = false;
+            break;
+        }
+
+        case OP_NOT: {
+            int reg = to_reg(c, c->sp - 1, 0);
+            op_rr(S16, 0x85, reg, reg);                             // test r16, r16
+            setcc(CC_E, reg);
+            break;
+        }
+
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_MULFXP:
+        case OP_AND:
+        case OP_OR:
+            compile_binary_op(c, opcode);
+            break;
+
+        default:
+            if (is_comparison(opcode)) {
+                // branch on the flags directly, unless the branch starts a basic block of its own
+                if (next < end && (bc[next] == OP_JZ || bc[next] == OP_JNZ)
+                        && !(c->flags[next] & INSN_LABEL)) {
+                    compile_branch(c, opcode, bc[next] == OP_JZ, next,
+                                   next + 3 + (int16_t) (bc[next + 1] | bc[next + 2] << 8));
+                    pc = next;
+                }
+                else {
+                    compile_binary_op(c, opcode);
+                }
+            }
+            else if (stak_builtin_function(opcode)) {
+                compile_builtin(c, abs_pc, stak_builtin_function(opcode),
+                                stak_builtin_argc(opcode));
+            }
+            else {
+                flush(c);
+                exit_to_interpreter(c, CC_ALWAYS, abs_pc, c->sp, false);
+                live = false;
+            }
+        }
+    }
+
+    // a function can't fall off its end (see stak_verify)
+
+    for (size_t i = 0; i < c->num_fixups; i++) {
+        Fixup const* fixup = &c->fixups[i];
+
+        if (!fixup->absolute) {
+            patch(fixup->at, c->labels[fixup->target]);
+        }
+        else if (!code_overflow) {
+            memcpy(fixup->at, &c->labels[fixup->target], sizeof(uint8_t*));
+        }
+    }
+
+    for (size_t i = 0; i < c->num_stubs; i++) {
+        Stub const* stub = &c->stubs[i];
+
+        patch(stub->at, code_free);
+
+        if (stub->restore_budget) {
+            op_rm(S64, 0xFF, 0, JS, offsetof(JitState, budget));   // inc js->budget
+        }
+
+        op_rm(S64, 0x8D, RCX, FP, slot_disp(c, stub->depth));      // lea rcx, [slot]
+        mov_imm(RDX, (int32_t) c->index);
+        mov_imm(RAX, stub->pc);
+        patch(jump(CC_ALWAYS), exit_native);
+    }
+}
+
+void stak_jit_compile(Module const* mod, size_t func_index) {
+    Func const* func = &mod->functions[func_index];
+    size_t length = mod->bytecode_length - func->bytecode_offset;
+    Compiler c = {
+        .mod = mod,
+        .index = func_index,
+        .start = func->bytecode_offset,
+        .frame_base = func->argc + func->num_locals,
+        .flags = calloc(length + 1, 1),
+        .depth = malloc(length + 1),
+        .labels = calloc(length + 1, sizeof(uint8_t*)),
+        .fixups = malloc(length * sizeof(Fixup)),
+        .stubs = malloc(4 * length * sizeof(Stub)),
+    };
+    size_t* work = malloc(length * sizeof(size_t));
+
+    mod->hotness[func_index] = 0;
+
+    if (code_start && c.flags && c.depth && c.labels && c.fixups && c.stubs && work
+            && code_writable(true)) {
+        uint8_t* function_start = code_free;
+        size_t end = analyze(&c, work);
+
+        code_overflow = false;
+        compile_function(&c, end);
+
+        if (code_overflow) {
+            // out of space; this and anything that isn't compiled yet stays interpreted
+            code_free = function_start;
+        }
+        else {
+            TR(("jit: function %u: %u bytes of bytecode -> %u\n", (unsigned) func_index,
+                (unsigned) end, (unsigned) (code_free - function_start)));
+
+            for (size_t pc = 0; pc < end; pc++) {
+                if (c.labels[pc]) {
+                    mod->native[c.start + pc] = c.labels[pc];
+                }
+            }
+        }
+
+        code_executable();
+    }
+
+    free(c.flags);
+    free(c.depth);
+    free(c.labels);
+    free(c.fixups);
+    free(c.stubs);
+    free(work);
+}
+
+// entry and exit of native code
+static void emit_runtime(void) {
+    static int const saved_regs[] = {RBX, R12, R13, R14, R15};     // an odd number keeps alignment
+
+    // int enter_native(JitState* js: rdi, V* fp: rsi, void* entry: rdx)
+    enter_native = (int (*)(JitState*, V*, void*)) code_free;
+
+    for (int i = 0; i < 5; i++) {
+        push_reg(saved_regs[i]);
+    }
+
+    op_rr(S64, 0x89, RDI, JS);                                      // mov js, rdi
+    op_rr(S64, 0x89, RSI, FP);                                      // mov fp, rsi
+    op_rm(S64, 0x8B, THR, JS, offsetof(JitState, thr));
+    op_rm(S64, 0x8B, GLOBALS, JS, offsetof(JitState, globals));
+    op_rm(S64, 0x8B, NATIVE, JS, offsetof(JitState, native));
+    op_rr(S32, 0xFF, 4, RDX);                                       // jmp rdx
+
+    // eax: pc, edx: function index, rcx: sp
+    exit_native = code_free;
+    op_rm(S64, 0x89, RCX, JS, offsetof(JitState, sp));
+    op_rm(S64, 0x89, FP, JS, offsetof(JitState, fp));
+    op_rm(S32, 0x89, RDX, JS, offsetof(JitState, func_index));
+
+    for (int i = 4; i >= 0; i--) {
+        pop_reg(saved_regs[i]);
+    }
+
+    emit(0xC3);                                                     // ret
+}
+
+void stak_jit_reset(Module* mod) {
+    static bool failed;
+    void** native = realloc(mod->native, (mod->bytecode_length + 1) * sizeof(void*));
+    uint16_t* hotness = realloc(mod->hotness, (mod->num_functions + 1) * sizeof(uint16_t));
+
+    if (!native || !hotness) {
+        fprintf(stderr, "stak_jit_reset: out of memory\n");
+        exit(-1);
+    }
+
+    mod->native = native;
+    mod->hotness = hotness;
+
+    if (!code_start && !failed) {
+        // writable for now, emit_runtime comes next
+        void* mem = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (mem == MAP_FAILED) {
+            perror("jit: mmap");
+            failed = true;
+        }
+        else {
+            code_start = mem;
+            code_end = code_start + CODE_SIZE;
+        }
+    }
+    else if (code_start && !code_writable(true)) {
+        // the runtime would stay executable as it is, but nothing could be compiled anymore
+        exit(-1);
+    }
+
+    if (code_start) {
+        code_free = code_start;
+        emit_runtime();
+        code_executable();
+    }
+
+    for (size_t i = 0; i <= mod->bytecode_length; i++) {
+        native[i] = NULL;
+    }
+
+    for (size_t i = 0; i < mod->num_functions; i++) {
+        hotness[i] = code_start ? JIT_THRESHOLD : 0;
+    }
+}
+
+int stak_jit_run(JitState* js, V* fp, void* entry) {
+    return enter_native(js, fp, entry);
+}
+
+#endif
@@ -1,22 +1,183 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "debug.h"
 #include "periph.h"
 #include "stak-isa.h"
 #include "stak-vm.h"
 
+#ifdef HAVE_PROFILER
+#include "profiler.h"
+#endif
 
-static V stack[STACK_SIZE];
 
 // #define TR(x) printf x
 #define TR(x)
 
-#define CURR_FUNC (mod->functions[thr->func_index])
-#define DROP() --thr->sp
-#define TOP() stack[thr->sp - 1]
-#define POP() stack[--thr->sp]
-#define PUSH(x) stack[thr->sp++] = (x)
+// Threaded dispatch (a separate indirect jump at the end of every handler) relies on the
+// GCC "labels as values" extension. Other compilers, such as Open Watcom, get a plain switch.
+// Build with -DSTAK_SWITCH_DISPATCH to force the switch under GCC as well.
+#if defined(__GNUC__) && !defined(STAK_SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+// The interpreter state (pc, sp, fp and the current function) lives in local variables for
+// the whole run of stak_exec. It is only written back to the Thread at suspension points,
+// since the compiler cannot prove that stores to the operand stack don't alias *thr.
+#define SAVE_STATE() do {\
+            thr->func_index = func - mod->functions;\
+            thr->pc = pc - code;\
+            thr->sp = sp - stack;\
+            thr->fp = fp - stack;\
+        } while (0)
+
+#define DROP() --sp
+#define TOP() sp[-1]
+#define POP() *--sp
+#define PUSH(x) *sp++ = (x)
+
+// Operand access. Both representations are indexed by bytecode offset, so handlers advance
+// pc by the encoded instruction length either way; only operand fetch differs.
+#ifdef STAK_PREDECODE
+#define OPCODE() pc->opcode
+#define INDEX_OPERAND() pc->index
+#define VALUE_OPERAND() pc->value
+#define FUNC_OPERAND() pc->func
+#define JUMP() pc = code + pc->target
+#define BACKWARD_JUMP() (pc->target <= pc - code)
+#else
+#define OPCODE() pc[0]
+#define INDEX_OPERAND() pc[1]
+#define VALUE_OPERAND() ((V) (pc[1] | pc[2] << 8))
+#define FUNC_OPERAND() (&mod->functions[pc[1]])
+#define JUMP() pc += 3 + VALUE_OPERAND()
+#define BACKWARD_JUMP() (VALUE_OPERAND() < 0)
+#endif
+
+// stak_verify has checked that pc never leaves the code of the current function, so the
+// interpreter does not have to. Calls are the only point where the stack needs checking.
+
+#ifdef THREADED_DISPATCH
+#define CASE(id) op_##id
+#define DEFAULT op_invalid
+#define DISPATCH() do {\
+            TR(("[%04X] op %02X\tsp=%d\tfp=%d\n", (int) (pc - code), OPCODE(), (int) (sp - stack), (int) (fp - stack)));\
+            EXEC_HOOK_INSN();\
+            goto *dispatch_table[OPCODE()];\
+        } while (0)
+#else
+#define CASE(id) case id
+#define DEFAULT default
+#define DISPATCH() break
+#endif
+
+// a builtin implemented in C may suspend the thread (pause-frames)
+#define SUSPEND_POINT() if (thr->state != THREAD_EXECUTING) {\
+            SAVE_STATE();\
+            return false;\
+        }
+
+// Every backward jump and call uses up a unit of the budget, which bounds the work done between
+// two checks by the length of a function. On running out, the thread is left executing and
+// picks up from here on the next call of stak_exec.
+#define PREEMPTION_POINT() if (--budget == 0) {\
+            SAVE_STATE();\
+            return true;\
+        }
+
+#ifdef STAK_JIT
+// Count a call of, or backward jump in, a function towards compiling it
+#define JIT_HOT(index) if (mod->hotness[index] && --mod->hotness[index] == 0) {\
+            stak_jit_compile(mod, index);\
+        }
+
+// Continue in native code, if there is any for this point. It returns when it gets to something
+// that it leaves to the interpreter, or the thread suspends, or it has used up the budget at a
+// conditional backward jump.
+#define JIT_ENTER() if (mod->native[pc - code]) {\
+            jit.budget = budget;\
+            pc = code + stak_jit_run(&jit, fp, mod->native[pc - code]);\
+            budget = jit.budget;\
+            func = &mod->functions[jit.func_index];\
+            sp = jit.sp;\
+            fp = jit.fp;\
+            SUSPEND_POINT();\
+            if (budget == 0) {\
+                SAVE_STATE();\
+                return true;\
+            }\
+        }
+#endif
+
+// define some helper macros for the built-in library
+
+#define BUILTIN_0(id, c_name, name) CASE(id):\
+                TR(("  " name "\n")); \
+                ret_val = c_name(thr); \
+                PUSH(ret_val); \
+                pc += 1; \
+                SUSPEND_POINT(); \
+                DISPATCH();
+
+#define BUILTIN_1(id, c_name, name) CASE(id):\
+                sp -= 1; \
+                TR(("  " name " %d\n", sp[0])); \
+                ret_val = c_name(thr, sp[0]); \
+                PUSH(ret_val); \
+                pc += 1; \
+                SUSPEND_POINT(); \
+                DISPATCH();
+
+#define BUILTIN_UNARY_OP(id, operator, name) CASE(id):\
+                sp -= 1; \
+                TR(("  " name " %d\n", sp[0])); \
+                ret_val = operator sp[0]; \
+                PUSH(ret_val); \
+                pc += 1; \
+                DISPATCH();
+
+#define BUILTIN_2(id, c_name, name) CASE(id):\
+                sp -= 2; \
+                TR(("  " name " %d %d\n", sp[0], sp[1])); \
+                ret_val = c_name(thr, sp[0], sp[1]); \
+                PUSH(ret_val); \
+                pc += 1; \
+                SUSPEND_POINT(); \
+                DISPATCH();
+
+#define BUILTIN_BIN_OP(id, operator, name) CASE(id):\
+                sp -= 2; \
+                TR(("  %d " name " %d\n", sp[0], sp[1])); \
+                ret_val = sp[0] operator sp[1]; \
+                PUSH(ret_val); \
+                pc += 1; \
+                DISPATCH();
+
+#define BUILTIN_5(id, c_name, name) CASE(id):\
+                sp -= 5; \
+                TR(("  " name " %d %d %d %d %d\n", sp[0], sp[1], \
+                        sp[2], sp[3], sp[4])); \
+                ret_val = c_name(thr, sp[0], sp[1], \
+                        sp[2], sp[3], sp[4]); \
+                PUSH(ret_val); \
+                pc += 1; \
+                SUSPEND_POINT(); \
+                DISPATCH();
+
+#define BUILTIN_7(id, c_name, name) CASE(id):\
+                sp -= 7; \
+                TR(("  " name " %d %d %d %d %d %d %d\n", sp[0], sp[1], \
+                        sp[2], sp[3], sp[4], \
+                        sp[5], sp[6])); \
+                ret_val = c_name(thr, sp[0], sp[1], \
+                        sp[2], sp[3], sp[4], \
+                        sp[5], sp[6]); \
+                PUSH(ret_val); \
+                pc += 1; \
+                SUSPEND_POINT(); \
+                DISPATCH();
 
 static int pause_frames(Thread* thr, int count) {
     if (count > 0) {
@@ -26,229 +187,549 @@ static int pause_frames(Thread* thr, int count) {
     return 0;
 }
 
-void stak_exec(Module const* mod, Thread* thr) {
+#ifdef STAK_PREDECODE
+// pc overflow sentinel + padding, so that fuse() can look ahead past the end
+enum { SENTINEL_SLOTS = 4 };
+
+
+// Replace the first instruction of a common sequence with a superinstruction. The rest of the
+// sequence stays decoded in place, so a jump into the middle of it still works.
+static void fuse(Insn* code, size_t pc) {
+    Insn* i0 = &code[pc];
+    Insn const* i1 = i0 + insn_length(i0->opcode);
+    Insn const* i2 = i1 + insn_length(i1->opcode);
+    Insn const* i3 = i2 + insn_length(i2->opcode);
+
+    if (i0->opcode == OP_GETLOCAL && i1->opcode == OP_PUSHCONST) {
+        i0->value = i1->value;
+
+        if (i2->opcode == OP_ADD && i3->opcode == OP_SETLOCAL && i3->index == i0->index) {
+            i0->opcode = OP_INCLOCAL;
+        }
+        else if (i2->opcode == OP_JGE || i2->opcode == OP_JLT) {
+            i0->opcode = (i2->opcode == OP_JGE) ? OP_JGE_LOCAL_CONST : OP_JLT_LOCAL_CONST;
+            i0->target = i2->target;
+        }
+        else if (i2->opcode == OP_ADD) {
+            i0->opcode = OP_GETLOCAL_CONST_ADD;
+        }
+        else if (i2->opcode == OP_SUB) {
+            i0->opcode = OP_GETLOCAL_CONST_SUB;
+        }
+        else if (i2->opcode == OP_SHR) {
+            i0->opcode = OP_GETLOCAL_CONST_SHR;
+        }
+        else {
+            i0->opcode = OP_GETLOCAL_PUSHCONST;
+        }
+    }
+    else if (i0->opcode == OP_GETLOCAL && i1->opcode == OP_GETLOCAL) {
+        i0->index2 = i1->index;
+
+        if (i2->opcode == OP_JGE || i2->opcode == OP_JLT) {
+            i0->opcode = (i2->opcode == OP_JGE) ? OP_JGE_LOCAL_LOCAL : OP_JLT_LOCAL_LOCAL;
+            i0->target = i2->target;
+        }
+        else if (i2->opcode == OP_ADD) {
+            i0->opcode = OP_GETLOCAL2_ADD;
+        }
+        else if (i2->opcode == OP_SUB) {
+            i0->opcode = OP_GETLOCAL2_SUB;
+        }
+        else if (i2->opcode == OP_MUL) {
+            i0->opcode = OP_GETLOCAL2_MUL;
+        }
+        else {
+            i0->opcode = OP_GETLOCAL2;
+        }
+    }
+    else if (i0->opcode == OP_GETGLOBAL && i1->opcode == OP_GETLOCAL && i2->opcode == OP_MULFXP) {
+        i0->index2 = i1->index;
+
+        if (i3->opcode == OP_ADD) {
+            i0->opcode = OP_GETGLOBAL_GETLOCAL_MULFXP_ADD;
+        }
+        else {
+            i0->opcode = OP_GETGLOBAL_GETLOCAL_MULFXP;
+        }
+    }
+    else if (i0->opcode == OP_GETGLOBAL && i1->opcode == OP_ADD) {
+        i0->opcode = OP_GETGLOBAL_ADD;
+    }
+    else if (i0->opcode == OP_ADD && i1->opcode == OP_SETLOCAL) {
+        i0->opcode = OP_ADD_SETLOCAL;
+        i0->index = i1->index;
+    }
+}
+
+void stak_predecode(Module* mod) {
     uint8_t const* bc = mod->bytecode;
+    size_t length = mod->bytecode_length;
+
+    Insn* code = (Insn*) realloc(mod->code, (length + SENTINEL_SLOTS) * sizeof(Insn));
 
-    while (thr->state == THREAD_EXECUTING) {
-        if (thr->pc >= mod->bytecode_length) {
-            fprintf(stderr, "pc overflow\n");
-            exit(-1);
+    if (!code) {
+        fprintf(stderr, "stak_predecode: out of memory\n");
+        exit(-1);
+    }
+
+    // Decode starting at *every* offset, not just at instruction boundaries. This keeps the
+    // semantics of the raw interpreter even for a (malformed) jump into the middle of an
+    // instruction, and the instruction stream does not have to be walked function by function.
+    for (size_t pc = 0; pc < length; pc++) {
+        Insn* insn = &code[pc];
+        size_t len = insn_length(bc[pc]);
+
+        insn->opcode = bc[pc];
+        insn->index = 0;
+        insn->index2 = 0;
+        insn->value = 0;
+        insn->target = 0;
+        insn->func = NULL;
+
+        if (pc + len > length) {
+            // truncated instruction
+            insn->opcode = OP_PC_OVERFLOW;
+            continue;
         }
 
-        uint8_t opcode = bc[thr->pc++];
-        int8_t op1, op2;
-        V ret_val;
+        if (len == 2) {
+            insn->index = bc[pc + 1];
+        }
 
-        TR(("[%04X] op %02X\tsp=%d\tfp=%d\n", thr->pc - 1, opcode, thr->sp, thr->fp));
+        if (len == 3) {
+            insn->value = (V) (bc[pc + 1] | bc[pc + 2] << 8);
+        }
 
-        switch (opcode) {
-        case OP_CALLFUNC:
-            op1 = bc[thr->pc++];    // func_idx
-            TR(("  call/func %d\n", op1));
+        if (bc[pc] == OP_CALLFUNC) {
+            insn->func = &mod->functions[insn->index];
+        }
+        else if (is_jump(bc[pc])) {
+            long target = (long) pc + 3 + insn->value;
 
-            // save current pc
-            thr->frames[thr->frame].func_index = thr->func_index;
-            thr->frames[thr->frame].pc = thr->pc;
-            thr->frames[thr->frame].fp = thr->fp;
-            thr->frame++;
+            if (target < 0 || target > (long) length) {
+                target = length;
+            }
 
-            // call function
-            thr->func_index = op1;
-            thr->pc = mod->functions[op1].bytecode_offset;
+            insn->target = (uint16_t) target;
+        }
+    }
 
-            // pop args to locals + allocate space for the rest
-            thr->fp = thr->sp - mod->functions[op1].argc;
-            thr->sp += mod->functions[op1].num_locals;
-            break;
+    for (size_t i = 0; i < SENTINEL_SLOTS; i++) {
+        code[length + i].opcode = OP_PC_OVERFLOW;
+    }
 
-        // define some helper macros for the built-in library
+#ifdef HAVE_PROFILER
+    // the profiler reports on the bytecode ISA, so keep the instructions unfused
+    bool do_fuse = !profile_enabled;
+#else
+    bool do_fuse = true;
+#endif
 
-#define BUILTIN_0(id, c_name, name) case id:\
-                TR(("  " name "\n")); \
-                ret_val = c_name(thr); \
-                PUSH(ret_val); \
+    // fusion must look at the plain instructions that follow, so go front to back
+    for (size_t pc = 0; do_fuse && pc < length; pc++) {
+        fuse(code, pc);
+    }
+
+    mod->code = code;
+}
+#else
+void stak_predecode(Module* mod) {
+    mod->code = mod->bytecode;
+}
+#endif
+
+#define BUILTIN_NAME(kind, id, x, name) case id: return name;
+
+char const* stak_builtin_name(int opcode) {
+    switch (opcode) {
+    FOR_EACH_BUILTIN(BUILTIN_NAME)
+    default: return NULL;
+    }
+}
+
+#define ARGC_BUILTIN_0 0
+#define ARGC_BUILTIN_1 1
+#define ARGC_BUILTIN_UNARY_OP 1
+#define ARGC_BUILTIN_2 2
+#define ARGC_BUILTIN_BIN_OP 2
+#define ARGC_BUILTIN_5 5
+#define ARGC_BUILTIN_7 7
+#define BUILTIN_ARGC(kind, id, x, name) case id: return ARGC_##kind;
+
+int stak_builtin_argc(int opcode) {
+    switch (opcode) {
+    FOR_EACH_BUILTIN(BUILTIN_ARGC)
+    default: return -1;
+    }
+}
+
+#define FUNCTION_BUILTIN_0(c_name) (BuiltinFunction) c_name
+#define FUNCTION_BUILTIN_1(c_name) (BuiltinFunction) c_name
+#define FUNCTION_BUILTIN_UNARY_OP(operator) NULL
+#define FUNCTION_BUILTIN_2(c_name) (BuiltinFunction) c_name
+#define FUNCTION_BUILTIN_BIN_OP(operator) NULL
+#define FUNCTION_BUILTIN_5(c_name) (BuiltinFunction) c_name
+#define FUNCTION_BUILTIN_7(c_name) (BuiltinFunction) c_name
+#define BUILTIN_FUNCTION(kind, id, x, name) case id: return FUNCTION_##kind(x);
+
+BuiltinFunction stak_builtin_function(int opcode) {
+    switch (opcode) {
+    FOR_EACH_BUILTIN(BUILTIN_FUNCTION)
+    default: return NULL;
+    }
+}
+
+// stack depth of each instruction boundary as seen by the verifier; depths above MAX_DEPTH are
+// rejected, which leaves the two top values as markers
+enum {
+    MAX_DEPTH = 0xFD,
+    UNREACHED = 0xFE,
+    NOT_INSN = 0xFF,
+};
+
+static bool verify_error(char* error, size_t error_size, size_t func_index, size_t pc,
+                         char const* message) {
+    snprintf(error, error_size, "function %u at %04X: %s", (unsigned) func_index, (unsigned) pc,
+             message);
+    return false;
+}
+
+// A function's code runs up to the start of the function that follows it in the bytecode. Not all
+// of that has to be code of the function: the REPL leaves behind what it overwrites, so only the
+// instructions reached from the entry point are checked.
+static size_t function_end(Module const* mod, size_t start) {
+    size_t end = mod->bytecode_length;
+
+    for (size_t i = 0; i < mod->num_functions; i++) {
+        size_t offset = mod->functions[i].bytecode_offset;
+
+        if (offset > start && offset < end) {
+            end = offset;
+        }
+    }
+
+    return end;
+}
+
+// Carry stack depth d over from the instruction at pc to the one at next. Returns NULL, or what is
+// wrong; `outside` if next is not in the function.
+static char const* reach(uint8_t* depth, size_t start, size_t end, size_t pc, long next, int d,
+                         char const* outside, bool* again) {
+    if (next < (long) start || next >= (long) end) {
+        return outside;
+    }
+
+    if (depth[next - start] == NOT_INSN) {
+        return "jump into the middle of an instruction";
+    }
+    else if (depth[next - start] == UNREACHED) {
+        depth[next - start] = (uint8_t) d;
+        *again = *again || next <= (long) pc;
+    }
+    else if (depth[next - start] != d) {
+        return "stack depth differs between paths that merge";
+    }
+
+    return NULL;
+}
+
+// Sets retc[index] from the first ret reached, unless known already. A call of a function whose
+// retc is not known yet ends the path, as if it never returned; *stalled tells whether there was
+// one, and so whether the function has to be verified again once more retc are known.
+static bool verify_function(Module* mod, size_t index, uint8_t* retc, uint8_t* depth,
+                            bool* stalled, char* error, size_t error_size) {
+    Func const* func = &mod->functions[index];
+    uint8_t const* bc = mod->bytecode;
+    size_t start = func->bytecode_offset;
+    size_t end = function_end(mod, start);
+    int frame_base = func->argc + func->num_locals;
+    int max_depth = 0;
+
+#define FAIL(message) return verify_error(error, error_size, index, pc, message)
+
+    memset(depth, UNREACHED, end - start);
+    *stalled = false;
+
+    // Propagate the stack depth from the entry point. Most code is reached in the first sweep;
+    // another one is needed only when a backward jump reaches something new.
+    bool again;
+    depth[0] = 0;
+
+    do {
+        again = false;
+
+        // the bytes that are not reached are stepped over one by one, they need not be code
+        for (size_t pc = start; pc < end;
+             pc += (depth[pc - start] <= MAX_DEPTH) ? insn_length(bc[pc]) : 1) {
+            int d = depth[pc - start];
+            size_t len = insn_length(bc[pc]);
+            long target = 0;
+            bool falls_through = true;
+            int pops = 0, pushes = 0;
+            Func const* callee = NULL;
+
+            if (d > MAX_DEPTH) {
+                continue;
+            }
+
+            if (pc + len > end) {
+                FAIL("truncated instruction");
+            }
+
+            for (size_t i = 1; i < len; i++) {
+                if (depth[pc - start + i] <= MAX_DEPTH) {
+                    FAIL("jump into the middle of an instruction");
+                }
+
+                depth[pc - start + i] = NOT_INSN;
+            }
+
+            switch (bc[pc]) {
+            case OP_PUSHCONST:
+            case OP_ZERO:
+                pushes = 1;
                 break;
 
-#define BUILTIN_1(id, c_name, name) case id:\
-                thr->sp -= 1; \
-                TR(("  " name " %d\n", stack[thr->sp])); \
-                ret_val = c_name(thr, stack[thr->sp]); \
-                PUSH(ret_val); \
+            case OP_GETGLOBAL:
+            case OP_SETGLOBAL:
+                if (bc[pc + 1] >= mod->num_globals) {
+                    FAIL("global index out of range");
+                }
+
+                pushes = (bc[pc] == OP_GETGLOBAL);
+                pops = (bc[pc] == OP_SETGLOBAL);
                 break;
 
-#define BUILTIN_UNARY_OP(id, operator, name) case id:\
-                thr->sp -= 1; \
-                TR(("  " name " %d\n", stack[thr->sp])); \
-                ret_val = operator stack[thr->sp]; \
-                PUSH(ret_val); \
+            case OP_GETLOCAL:
+            case OP_SETLOCAL:
+                if (bc[pc + 1] >= func->argc + func->num_locals) {
+                    FAIL("local index out of range");
+                }
+
+                pushes = (bc[pc] == OP_GETLOCAL);
+                pops = (bc[pc] == OP_SETLOCAL);
                 break;
 
-#define BUILTIN_2(id, c_name, name) case id:\
-                thr->sp -= 2; \
-                TR(("  " name " %d %d\n", stack[thr->sp], stack[thr->sp + 1])); \
-                ret_val = c_name(thr, stack[thr->sp], stack[thr->sp + 1]); \
-                PUSH(ret_val); \
+            case OP_DROP:
+                pops = 1;
                 break;
 
-#define BUILTIN_BIN_OP(id, operator, name) case id:\
-                thr->sp -= 2; \
-                TR(("  %d " name " %d\n", stack[thr->sp], stack[thr->sp + 1])); \
-                ret_val = stack[thr->sp] operator stack[thr->sp + 1]; \
-                PUSH(ret_val); \
+            case OP_CALLFUNC:
+                if (bc[pc + 1] >= mod->num_functions) {
+                    FAIL("function index out of range");
+                }
+
+                callee = &mod->functions[bc[pc + 1]];
+                pops = callee->argc;
+                // a call of a function that never returns does not continue either
+                pushes = (retc[bc[pc + 1]] == NO_RETURN) ? 0 : retc[bc[pc + 1]];
+                falls_through = (retc[bc[pc + 1]] != NO_RETURN);
+                *stalled = *stalled || !falls_through;
                 break;
 
-#define BUILTIN_5(id, c_name, name) case id:\
-                thr->sp -= 5; \
-                TR(("  " name " %d %d %d %d %d\n", stack[thr->sp], stack[thr->sp + 1], \
-                        stack[thr->sp + 2], stack[thr->sp + 3], stack[thr->sp + 4])); \
-                ret_val = c_name(thr, stack[thr->sp], stack[thr->sp + 1], \
-                        stack[thr->sp + 2], stack[thr->sp + 3], stack[thr->sp + 4]); \
-                PUSH(ret_val); \
+            case OP_RET:
+                if (d != bc[pc + 1]) {
+                    FAIL("stack depth at ret does not match the number of return values");
+                }
+
+                if (retc[index] != NO_RETURN && bc[pc + 1] != retc[index]) {
+                    FAIL("inconsistent number of return values");
+                }
+
+                retc[index] = bc[pc + 1];
+                falls_through = false;
                 break;
 
-#define BUILTIN_7(id, c_name, name) case id:\
-                thr->sp -= 7; \
-                TR(("  " name " %d %d %d %d %d %d %d\n", stack[thr->sp], stack[thr->sp + 1], \
-                        stack[thr->sp + 2], stack[thr->sp + 3], stack[thr->sp + 4], \
-                        stack[thr->sp + 5], stack[thr->sp + 6])); \
-                ret_val = c_name(thr, stack[thr->sp], stack[thr->sp + 1], \
-                        stack[thr->sp + 2], stack[thr->sp + 3], stack[thr->sp + 4], \
-                        stack[thr->sp + 5], stack[thr->sp + 6]); \
-                PUSH(ret_val); \
+            case OP_JMP:
+                target = (long) pc + 3 + (int16_t) (bc[pc + 1] | bc[pc + 2] << 8);
+                falls_through = false;
                 break;
 
-            // math
-            BUILTIN_BIN_OP(128, +, "+");
-            BUILTIN_BIN_OP(129, -, "-");
-            BUILTIN_BIN_OP(130, *, "*");
-            BUILTIN_BIN_OP(131, /, "/");
-            BUILTIN_BIN_OP(132, %, "%%");
-            BUILTIN_BIN_OP(133, <<, "<<");
-            BUILTIN_BIN_OP(134, >>, ">>");
-            BUILTIN_2(135, mul_fxp, "mul@");
-            BUILTIN_1(136, sin_fxp, "sin@");
-            BUILTIN_1(137, cos_fxp, "cos@");
-
-            // comparison + logic
-            BUILTIN_BIN_OP(144, <, "<");
-            BUILTIN_BIN_OP(145, <=, "<=");
-            BUILTIN_BIN_OP(146, ==, "=");
-            BUILTIN_BIN_OP(147, !=, "!=");
-            BUILTIN_BIN_OP(148, >, ">");
-            BUILTIN_BIN_OP(149, >=, ">=");
-            BUILTIN_UNARY_OP(150, !, "not");
-            BUILTIN_BIN_OP(151, &&, "and");
-            BUILTIN_BIN_OP(152, ||, "or");
-
-            // graphics
-            BUILTIN_5(176, draw_line, "draw-line");
-            BUILTIN_5(177, fill_rect, "fill-rect");
-            BUILTIN_7(178, fill_triangle, "fill-triangle");
-            BUILTIN_1(179, pause_frames, "pause-frames");
-
-            // keyboard
-            BUILTIN_1(192, key_pressed, "key-pressed?");
-            BUILTIN_1(193, key_released, "key-released?");
-            BUILTIN_1(194, key_held, "key-held?");
-
-            // random
-            BUILTIN_0(208, do_random, "random");
-            BUILTIN_1(209, set_random_seed, "set-random-seed!");
-
-        case OP_DROP:
-            TR(("  drop\n"));
-            DROP();
-            break;
-
-        case OP_GETGLOBAL:
-            op1 = bc[thr->pc++];    // index
-            TR(("  getglobal %d\n", op1));
-            PUSH(mod->globals[op1]);
-            break;
-
-        case OP_GETLOCAL:
-            op1 = bc[thr->pc++];    // index
-            TR(("  getlocal %d\t(value=%d)\n", op1, stack[thr->fp + op1]));
-            PUSH(stack[thr->fp + op1]);
-            break;
-
-        case OP_JMP:
-            op1 = bc[thr->pc++];    // distance LSB
-            op2 = bc[thr->pc++];    // distance MSB
-            TR(("  jmp %+d\n", (op2 << 8 | (uint8_t)op1)));
-            thr->pc += (op2 << 8 | (uint8_t)op1);
-            break;
-
-        case OP_JZ:
-            op1 = bc[thr->pc++];    // distance LSB
-            op2 = bc[thr->pc++];    // distance MSB
-            TR(("  jz %+d\n", (op2 << 8 | (uint8_t)op1)));
-            if (POP() == 0) {
-                thr->pc += (op2 << 8 | (uint8_t)op1);
+            case OP_JZ:
+            case OP_JNZ:
+                target = (long) pc + 3 + (int16_t) (bc[pc + 1] | bc[pc + 2] << 8);
+                pops = 1;
+                break;
+
+            case OP_JLT:
+            case OP_JLE:
+            case OP_JEQ:
+            case OP_JNE:
+            case OP_JGT:
+            case OP_JGE:
+                target = (long) pc + 3 + (int16_t) (bc[pc + 1] | bc[pc + 2] << 8);
+                pops = 2;
+                break;
+
+            case OP_SWITCH:
+                // the table entries are the successors, the first of them is also the next insn
+                for (size_t i = 0; i < switch_entries(&bc[pc]); i++) {
+                    size_t entry = pc + 2 + 3 * i;
+
+                    if (entry + 3 > end || bc[entry] != OP_JMP) {
+                        FAIL("switch table is not followed by its jmp instructions");
+                    }
+                }
+
+                pops = 1;
+                break;
+
+            default:
+                if (stak_builtin_argc(bc[pc]) < 0) {
+                    FAIL("invalid opcode");
+                }
+
+                pops = stak_builtin_argc(bc[pc]);
+                pushes = 1;
             }
-            break;
-
-        case OP_PUSHCONST:
-            op1 = bc[thr->pc++];    // LSB
-            op2 = bc[thr->pc++];    // MSB
-
-            TR(("  pushconst "));
-            PUSH(((uint8_t)op2) << 8 | (uint8_t)op1);
-            TR((" %d\n", stack[thr->sp - 1]));
-            break;
-
-        case OP_RET:
-            op1 = bc[thr->pc++];    // retc
-            TR(("  ret %d\n", op1));
-
-            // TODO: stop abusing ret_val as a temporary, the compiler is not so dumb
-            // at this point: thr->sp == thr->fp + argc + nloc + retc
-            // rightmost:   [thr->sp - 1]    => [thr->sp - nloc - argc - retc + retc - 1]
-            // ...
-            // leftmost:    [thr->sp - retc] => [thr->sp - nloc - argc - retc]
-            thr->sp -= op1;
-            for (ret_val = 0; ret_val < op1; ret_val++) {
-                stack[thr->sp - CURR_FUNC.num_locals - CURR_FUNC.argc] = stack[thr->sp];
-                thr->sp++;
+
+            if (d < pops) {
+                FAIL("stack underflow");
+            }
+
+            // the callee's frame starts at its first argument
+            if (callee && func->stack_size != 0 && (callee->stack_size == 0
+                    || frame_base + d - callee->argc + callee->stack_size > func->stack_size
+                    || callee->call_depth + 1 > func->call_depth)) {
+                FAIL("call exceeds the stack size or call depth in the function table");
             }
 
-            thr->sp = thr->sp - CURR_FUNC.num_locals - CURR_FUNC.argc;
+            d = d - pops + pushes;
 
-            if (thr->frame == 0) {
-                TR(("  return from main -> %d value(s) (sp = %d)\n", ret_val, thr->sp));
-                thr->state = THREAD_TERMINATED;
-                // a well-formed program should always terminate with thr->sp == ret_val... I think
-                debug_on_program_completion(ret_val, &stack[thr->sp - ret_val]);
-                return;
+            if (d > max_depth) {
+                if (d > MAX_DEPTH) {
+                    FAIL("stack too deep");
+                }
+
+                max_depth = d;
             }
 
-            // restore fp & pc
-            thr->frame--;
-            thr->fp = thr->frames[thr->frame].fp;
-            thr->pc = thr->frames[thr->frame].pc;
-            thr->func_index = thr->frames[thr->frame].func_index;
-            break;
+            char const* message = NULL;
 
-        case OP_SETGLOBAL:
-            op1 = bc[thr->pc++];    // index
-            TR(("  setglobal %d\n", op1));
-            mod->globals[op1] = POP();
-            break;
+            if (falls_through) {
+                message = reach(depth, start, end, pc, (long) (pc + len), d,
+                                "execution falls off the end of the function", &again);
+            }
 
-        case OP_SETLOCAL:
-            op1 = bc[thr->pc++];    // index
-            TR(("  setlocal %d\t(value=%d)\n", op1, TOP()));
-            stack[thr->fp + op1] = POP();
-            break;
+            if (!message && is_jump(bc[pc])) {
+                message = reach(depth, start, end, pc, target, d, "jump out of the function",
+                                &again);
+            }
 
-        case OP_ZERO:
-            TR(("  zero\n"));
-            PUSH(0);
-            break;
+            for (size_t i = 1; !message && bc[pc] == OP_SWITCH && i < switch_entries(&bc[pc]);
+                 i++) {
+                message = reach(depth, start, end, pc, (long) (pc + 2 + 3 * i), d,
+                                "jump out of the function", &again);
+            }
 
-        default:
-            printf("  opcode error %d\n", opcode);
-            exit(0);
+            if (message) {
+                FAIL(message);
+            }
         }
+    } while (again);
+
+    mod->stack_needed[index] = frame_base + max_depth;
+
+    if (func->stack_size != 0 && mod->stack_needed[index] > func->stack_size) {
+        size_t pc = start;
+        FAIL("stack size in the function table is too small");
     }
+
+#undef FAIL
+
+    return true;
+}
+
+bool stak_verify(Module* mod, char* error, size_t error_size) {
+    size_t n = mod->num_functions;
+    uint8_t* retc = realloc(mod->retc, n ? n : 1);
+    uint16_t* stack_needed = realloc(mod->stack_needed, (n ? n : 1) * sizeof(uint16_t));
+    bool* stalled = malloc((n ? n : 1) * sizeof(bool));
+    bool ok = true;
+
+    if (!retc || !stack_needed || !stalled) {
+        fprintf(stderr, "stak_verify: out of memory\n");
+        exit(-1);
+    }
+
+    mod->stack_needed = stack_needed;
+    mod->retc = retc;
+
+    for (size_t i = 0; i < n && ok; i++) {
+        if (mod->functions[i].bytecode_offset >= mod->bytecode_length) {
+            ok = verify_error(error, error_size, i, mod->functions[i].bytecode_offset,
+                              "function starts past the end of the bytecode");
+        }
+
+        retc[i] = NO_RETURN;
+        stalled[i] = true;
+    }
+
+    // Functions are verified again for as long as that makes more of their callees return. What is
+    // still NO_RETURN in the end never returns.
+    bool changed = true;
+
+    while (ok && changed) {
+        changed = false;
+
+        for (size_t i = 0; i < n && ok; i++) {
+            size_t start = mod->functions[i].bytecode_offset;
+            uint8_t before = retc[i];
+            uint8_t* depth;
+
+            if (!stalled[i]) {
+                continue;
+            }
+
+            depth = malloc(function_end(mod, start) - start);
+
+            if (!depth) {
+                fprintf(stderr, "stak_verify: out of memory\n");
+                exit(-1);
+            }
+
+            ok = verify_function(mod, i, retc, depth, &stalled[i], error, error_size);
+            changed = changed || retc[i] != before;
+            free(depth);
+        }
+    }
+
+    free(stalled);
+    return ok;
+}
+
+#define EXEC_NAME stak_exec_normal
+#ifdef STAK_JIT
+#define EXEC_JIT
+#endif
+#include "stak-exec.h"
+#undef EXEC_NAME
+
+#ifdef HAVE_PROFILER
+#define EXEC_NAME stak_exec_profiled
+#define EXEC_HOOK_INSN() profile_insn(OPCODE())
+#define EXEC_HOOK_CALL(index) profile.calls[index]++
+#include "stak-exec.h"
+#undef EXEC_NAME
+
+#define EXEC_NAME stak_exec_sampled
+#define EXEC_HOOK_INSN() if (--sample_countdown == 0) {\
+            sampler_take(thr, func - mod->functions, pc - code);\
+        }
+#include "stak-exec.h"
+#undef EXEC_NAME
+#endif
+
+bool stak_exec(Module const* mod, Thread* thr, long budget) {
+#ifdef HAVE_PROFILER
+    if (profile_enabled) {
+        return stak_exec_profiled(mod, thr, budget);
+    }
+    else if (sampler_enabled) {
+        return stak_exec_sampled(mod, thr, budget);
+    }
+#endif
+
+    return stak_exec_normal(mod, thr, budget);
 }
@@ -5,9 +5,26 @@
 #include <stdlib.h>
 
 
+// On hosted platforms the bytecode is translated at load time into an array of pre-decoded
+// instructions, with one entry per byte of bytecode. That is too much memory for real-mode DOS,
+// where the raw bytecode is interpreted directly.
+#if !defined(__WATCOMC__) && !defined(STAK_NO_PREDECODE)
+#define STAK_PREDECODE
+#endif
+
+// On x86-64 Linux, hot functions are compiled to machine code (see stak-jit.c). Build with
+// -DSTAK_NO_JIT to interpret everything.
+#if defined(__x86_64__) && defined(__linux__) && !defined(STAK_NO_JIT)
+#define STAK_JIT
+#endif
+
+// Threads are normally given exactly as much memory as the linker has worked out for their entry
+// function (see Func). These sizes apply when it couldn't, because the code may recurse.
 enum {
-    MAX_FRAMES = 64,
-    STACK_SIZE = 1024,
+    MAX_FRAMES = 64,            // also the limit on call depth in any thread
+    STACK_SIZE = 1024,          // operand stack of the main thread
+    SPAWN_STACK_SIZE = 256,     // operand stack of a thread started by spawn
+    MAX_THREADS = 8,
 };
 
 enum {
@@ -16,6 +33,10 @@ enum {
     THREAD_SUSPENDED,
 };
 
+enum {
+    NO_RETURN = 0xFE,           // Module.retc of a function that never returns
+};
+
 typedef int16_t V;
 
 typedef struct {
@@ -36,20 +57,107 @@ typedef struct {
     int fp;
     int frame;
 
-    Frame frames[MAX_FRAMES];
+    V* stack;               // operand stack; sp and fp are indices into it
+    int stack_size;
+
+    Frame* frames;          // caller of each active call
+    int max_frames;
 } Thread;
 
 typedef struct {
     uint8_t argc, num_locals;
     uint16_t bytecode_offset;
+
+    // Worst case over everything a call of this function can lead to, as computed by the linker:
+    // stack values used from the function's first argument up, and number of nested calls.
+    // stack_size is 0 if there is no bound (the function may recurse).
+    uint16_t stack_size;
+    uint8_t call_depth;
+    uint8_t reserved;
 } Func;
 
+#ifdef STAK_PREDECODE
+typedef struct {
+    uint8_t opcode;
+    uint8_t index;              // local/global/function index, retc
+    uint8_t index2;             // second index of a superinstruction
+    V value;                    // PUSHCONST
+    uint16_t target;            // JMP, JZ: absolute bytecode offset
+    Func const* func;           // CALLFUNC
+} Insn;
+#else
+typedef uint8_t Insn;
+#endif
+
 typedef struct {
     Func* functions;
-    //size_t num_functions;
+    size_t num_functions;
     V* globals;
+    size_t num_globals;
     uint8_t* bytecode;
     size_t bytecode_length;
+    Insn* code;                 // executable form of bytecode, see stak_predecode
+    uint16_t* stack_needed;     // per function: argc + num_locals + max. depth, see stak_verify
+    uint8_t* retc;              // per function: number of values returned, see stak_verify
+#ifdef STAK_JIT
+    void** native;              // per bytecode offset: native code to continue at, or NULL
+    uint16_t* hotness;          // per function: calls + backward jumps left until it is compiled
+#endif
 } Module;
 
-void stak_exec(Module const* mod, Thread* thr);
+#ifdef STAK_JIT
+// Interpreter state handed to native code and back (see stak_jit_run)
+typedef struct {
+    Thread* thr;
+    V* stack;
+    V const* stack_end;
+    V* globals;
+    void* const* native;        // mod->native
+    long budget;                // as passed to stak_exec, counting down
+
+    // where the interpreter is to continue
+    V* sp;
+    V* fp;
+    int func_index;
+} JitState;
+#endif
+
+// Check every function before the module is run: in the code reachable from its entry, opcodes and
+// operand indices must be valid, jumps must land on an instruction boundary of the same function,
+// and the operand stack must not underflow and must have the same depth on all paths that meet.
+// The stack size and call depth claimed in the function table must hold. Also fills
+// mod->stack_needed and mod->retc.
+// Returns false with a description of the first problem in `error` if the module is rejected.
+bool stak_verify(Module* mod, char* error, size_t error_size);
+
+// (Re-)build mod->code from mod->bytecode. Must be called after any change to the bytecode.
+void stak_predecode(Module* mod);
+// Run the thread until it pauses or terminates, or until it has made `budget` calls and backward
+// jumps (no limit if budget <= 0). Returns true in the last case; the thread is then still
+// executing and continues where it left off on the next call.
+bool stak_exec(Module const* mod, Thread* thr, long budget);
+
+// Builtin `spawn`: start a new thread in the function func_index, which takes no arguments.
+// Implemented by the host (interp.c), which owns the threads. Returns the thread number or -1.
+int stak_spawn(Thread* thr, int func_index);
+
+// name of a builtin as used in STAK source, or NULL if the opcode is not a builtin
+char const* stak_builtin_name(int opcode);
+// number of arguments of a builtin (all return one value), or -1 if the opcode is not a builtin
+int stak_builtin_argc(int opcode);
+
+typedef void (*BuiltinFunction)(void);
+// C function implementing a builtin, called as f(thr, arg1, ...). NULL for the operators, which
+// are implemented in the interpreter itself.
+BuiltinFunction stak_builtin_function(int opcode);
+
+#ifdef STAK_JIT
+// Discard all native code and prepare the JIT for the module. Must be called after any change to
+// the module's code or function table, as well as before it is first run.
+void stak_jit_reset(Module* mod);
+// Compile the function, for stak_exec to use from now on. Called once it has become hot.
+void stak_jit_compile(Module const* mod, size_t func_index);
+// Run the native code at `entry` with the frame pointer fp. Returns the bytecode offset where the
+// interpreter is to continue; js->sp, fp and func_index are updated to match.
+int stak_jit_run(JitState* js, V* fp, void* entry);
+#endif
@@ -0,0 +1,154 @@
+// Runtime of a program translated to C by stak2c. Schedules the threads frame by frame, the same
+// way as interp.c does for bytecode.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "periph.h"
+#include "stak2c.h"
+
+Thread threads[MAX_THREADS];    // threads[0] runs main
+
+// Make sure that t has the memory for a thread starting in the function entry (see interp.c).
+// The entry function keeps its resume point in a Frame too, hence one more than calls.
+static bool thread_reserve(Thread* t, Func const* entry, int default_stack_size) {
+    int stack_size = entry->stack_size ? entry->stack_size : default_stack_size;
+    int max_frames = (entry->stack_size && entry->call_depth < MAX_FRAMES) ? entry->call_depth
+                                                                           : MAX_FRAMES;
+
+    if (t->stack_size < stack_size) {
+        V* stack = realloc(t->stack, stack_size * sizeof(V));
+
+        if (!stack) {
+            return false;
+        }
+
+        t->stack = stack;
+        t->stack_size = stack_size;
+    }
+
+    if (!t->frames || t->max_frames < max_frames) {
+        Frame* frames = realloc(t->frames, (max_frames + 1) * sizeof(Frame));
+
+        if (!frames) {
+            return false;
+        }
+
+        t->frames = frames;
+        t->max_frames = max_frames;
+    }
+
+    return true;
+}
+
+// Threads are started with thr->frame = 0. It is set once the thread has suspended, so that it
+// is resumed from thr->frames rather than started over.
+static void start_thread(Thread* t, int func_index) {
+    t->func_index = func_index;
+    t->frame = 0;
+}
+
+int stak_spawn(Thread* thr, int func_index) {
+    if (func_index < 0 || (size_t) func_index >= stak2c_num_functions
+            || stak2c_functions[func_index].argc != 0) {
+        return -1;
+    }
+
+    for (int i = 1; i < MAX_THREADS; i++) {
+        Thread* t = &threads[i];
+
+        if (t->state != THREAD_TERMINATED) {
+            continue;
+        }
+
+        if (!thread_reserve(t, &stak2c_functions[func_index], SPAWN_STACK_SIZE)
+                || stak2c_stack_needed[func_index] > t->stack_size) {
+            return -1;
+        }
+
+        // start on the next frame, as in interp.c
+        t->state = THREAD_SUSPENDED;
+        t->frames_paused = 1;
+        start_thread(t, func_index);
+        return i;
+    }
+
+    return -1;
+}
+
+int pause_frames(Thread* thr, int count) {
+    if (count > 0) {
+        thr->state = THREAD_SUSPENDED;
+        thr->frames_paused = count;
+    }
+    return 0;
+}
+
+void stak2c_stack_overflow(void) {
+    fprintf(stderr, "stack overflow\n");
+    exit(-1);
+}
+
+static void run_thread(Thread* t) {
+    if (t->state != THREAD_EXECUTING) {
+        return;
+    }
+
+    if (stak2c_code[t->func_index](t, t->stack, t->frames, t->frame != 0) == STAK2C_RETURNED) {
+        t->state = THREAD_TERMINATED;
+    }
+    else {
+        t->frame = 1;
+    }
+}
+
+static bool any_thread_alive(void) {
+    for (int i = 0; i < MAX_THREADS; i++) {
+        if (threads[i].state != THREAD_TERMINATED) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int main(int argc, char** argv) {
+    Thread* const thr = &threads[0];
+    int main_function = stak2c_main_function;
+
+    if (!thread_reserve(thr, &stak2c_functions[main_function], STACK_SIZE)
+            || stak2c_stack_needed[main_function] > thr->stack_size) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+
+    thr->state = THREAD_EXECUTING;
+    start_thread(thr, main_function);
+
+    periph_init();
+
+    while (any_thread_alive()) {
+        frame_start();
+
+        // wake up everything that is due before running anything (see interp.c)
+        for (int i = 0; i < MAX_THREADS; i++) {
+            Thread* t = &threads[i];
+
+            if (t->frames_paused) {
+                t->frames_paused--;
+
+                if (t->frames_paused == 0) {
+                    t->state = THREAD_EXECUTING;
+                }
+            }
+        }
+
+        for (int i = 0; i < MAX_THREADS; i++) {
+            run_thread(&threads[i]);
+        }
+
+        frame_end();
+    }
+
+    periph_shutdown();
+}
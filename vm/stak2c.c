@@ -0,0 +1,826 @@
+// stak2c: ahead-of-time translator from a linked bytecode module (.bc) to a C99 source file,
+// which is then built with stak2c-main.c and one of the peripheral backends in place of the VM.
+//
+//     stak2c wirefram.bc -o wirefram.c
+//
+// Each function becomes a C function. The depth of the operand stack is known at every
+// instruction, so the stack can be kept in C variables as well as the locals: operand stack slot
+// i is s<i> and local i is l<i>. The operators are evaluated in the same types as in the
+// interpreter (V operands, result stored back to a V), so they wrap around the same way.
+//
+// The state of a thread only has to be in memory where it may suspend, which is after a builtin
+// implemented by the host (pause-frames) and after a call of a function that may get to one.
+// There, a function stores its live values on the thread's operand stack and its resume point in
+// its Frame, and returns STAK2C_SUSPENDED, as does each of its callers in turn. The runtime
+// resumes the thread by calling its entry function again, which reloads its state and goes back
+// into the call where it left off, and so on (see stak2c.h).
+//
+// Unlike the VM, a translated program has no execution budget and no debugger.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stak-isa.h"
+#include "stak-vm.h"
+
+// header of a .bc file, as read by interp.c
+typedef struct {
+    uint16_t bytecode_length;
+    uint8_t num_functions;
+    uint8_t num_globals;
+    uint8_t main_func_idx;
+    uint8_t pad[3];
+} Hdr;
+
+enum {
+    HOST_CALL = 1,              // C function, called as f(thr, arg1, ...)
+    BIN_OP,
+    UNARY_OP,
+};
+
+#define KIND_BUILTIN_0 HOST_CALL, 0
+#define KIND_BUILTIN_1 HOST_CALL, 1
+#define KIND_BUILTIN_2 HOST_CALL, 2
+#define KIND_BUILTIN_5 HOST_CALL, 5
+#define KIND_BUILTIN_7 HOST_CALL, 7
+#define KIND_BUILTIN_BIN_OP BIN_OP, 2
+#define KIND_BUILTIN_UNARY_OP UNARY_OP, 1
+#define BUILTIN_INFO(kind, id, x, name) [id] = {KIND_##kind, #x},
+
+static struct {
+    uint8_t kind;               // 0 if the opcode is not a builtin
+    uint8_t argc;
+    char const* c;              // C function or operator
+} const builtins[256] = {
+    FOR_EACH_BUILTIN(BUILTIN_INFO)
+};
+
+// stack depth of each bytecode offset of a function
+enum {
+    UNREACHED = -1,
+    NOT_INSN = -2,
+};
+
+typedef struct {
+    size_t start, end;
+    int frame_base;             // argc + num_locals
+    int max_depth;
+    int retc;                   // NO_RETURN if it never returns
+    bool may_suspend;           // may get to a builtin that suspends the thread
+    int* depth;                 // per offset from start
+    bool* target;               // per offset from start: jumped to
+    bool local_read[256];
+    bool local_set[256];
+    bool slot_read[256];
+} Function;
+
+static char const* filename;
+static Hdr hdr;
+static Func const* functions;
+static V const* globals;
+static uint8_t const* bc;
+static Function* funcs;
+static FILE* out;
+
+static void fail(size_t func_index, size_t pc, char const* message) {
+    fprintf(stderr, "%s: function %u at %04X: %s\n", filename, (unsigned) func_index,
+            (unsigned) pc, message);
+    exit(1);
+}
+
+static void* alloc(size_t size) {
+    void* p = calloc(size ? size : 1, 1);
+
+    if (!p) {
+        fprintf(stderr, "stak2c: out of memory\n");
+        exit(1);
+    }
+
+    return p;
+}
+
+static void put(char const* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(out, format, args);
+    va_end(args);
+}
+
+// a builtin that may suspend the thread, so that the state must be saved and checked after it.
+// mul@ is called much too often to be treated like the others, and never suspends anyway.
+static bool is_suspension_point(int opcode) {
+    return builtins[opcode].kind == HOST_CALL && opcode != OP_MULFXP;
+}
+
+// ANALYSIS
+
+// a function's code runs up to the start of the function that follows it in the bytecode
+static size_t function_end(size_t start) {
+    size_t end = hdr.bytecode_length;
+
+    for (size_t i = 0; i < hdr.num_functions; i++) {
+        if (functions[i].bytecode_offset > start && functions[i].bytecode_offset < end) {
+            end = functions[i].bytecode_offset;
+        }
+    }
+
+    return end;
+}
+
+// Check the code and operands of a function and find its number of return values. This is a
+// lighter version of stak_verify, just enough to make sure that the translation is valid C.
+static void scan(size_t index) {
+    Function* f = &funcs[index];
+    Func const* func = &functions[index];
+
+    if (func->bytecode_offset >= hdr.bytecode_length) {
+        fail(index, func->bytecode_offset, "function starts past the end of the bytecode");
+    }
+
+    f->start = func->bytecode_offset;
+    f->end = function_end(f->start);
+    f->frame_base = func->argc + func->num_locals;
+    f->retc = NO_RETURN;
+    f->depth = alloc((f->end - f->start) * sizeof(int));
+    f->target = alloc(f->end - f->start);
+
+    for (size_t pc = f->start; pc < f->end; pc += insn_length(bc[pc])) {
+        size_t len = insn_length(bc[pc]);
+
+        if (pc + len > f->end) {
+            fail(index, pc, "truncated instruction");
+        }
+
+        f->depth[pc - f->start] = UNREACHED;
+
+        for (size_t i = 1; i < len; i++) {
+            f->depth[pc - f->start + i] = NOT_INSN;
+        }
+
+        switch (bc[pc]) {
+        case OP_PUSHCONST:
+        case OP_ZERO:
+        case OP_DROP:
+        case OP_JMP:
+        case OP_JZ:
+        case OP_JNZ:
+        case OP_JLT:
+        case OP_JLE:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JGT:
+        case OP_JGE:
+            break;
+
+        case OP_SWITCH:
+            for (size_t i = 0; i < switch_entries(&bc[pc]); i++) {
+                size_t entry = pc + 2 + 3 * i;
+
+                if (entry + 3 > f->end || bc[entry] != OP_JMP) {
+                    fail(index, pc, "switch table is not followed by its jmp instructions");
+                }
+            }
+            break;
+
+        case OP_GETGLOBAL:
+        case OP_SETGLOBAL:
+            if (bc[pc + 1] >= hdr.num_globals) {
+                fail(index, pc, "global index out of range");
+            }
+            break;
+
+        case OP_GETLOCAL:
+        case OP_SETLOCAL:
+            if (bc[pc + 1] >= f->frame_base) {
+                fail(index, pc, "local index out of range");
+            }
+            break;
+
+        case OP_CALLFUNC:
+            if (bc[pc + 1] >= hdr.num_functions) {
+                fail(index, pc, "function index out of range");
+            }
+            break;
+
+        case OP_RET:
+            if (f->retc != NO_RETURN && bc[pc + 1] != f->retc) {
+                fail(index, pc, "inconsistent number of return values");
+            }
+            f->retc = bc[pc + 1];
+            break;
+
+        default:
+            if (!builtins[bc[pc]].kind) {
+                fail(index, pc, "invalid opcode");
+            }
+        }
+    }
+}
+
+static size_t jump_target(size_t pc) {
+    return pc + 3 + (int16_t) (bc[pc + 1] | bc[pc + 2] << 8);
+}
+
+// Work out the stack depth at every instruction, and which locals and stack slots are used
+static void analyze(size_t index) {
+    Function* f = &funcs[index];
+    size_t* worklist = alloc((f->end - f->start) * sizeof(size_t));
+    size_t num_work = 0;
+
+    f->depth[0] = 0;
+    worklist[num_work++] = f->start;
+
+    while (num_work) {
+        size_t pc = worklist[--num_work];
+        int d = f->depth[pc - f->start];
+        int pops = 0, pushes = 0;
+        bool value_used = true;         // the popped values are read
+        bool falls_through = true;
+        long successors[UINT8_MAX + 2];
+        int num_successors = 0;
+
+        switch (bc[pc]) {
+        case OP_PUSHCONST:
+        case OP_ZERO:
+        case OP_GETGLOBAL:
+            pushes = 1;
+            break;
+
+        case OP_GETLOCAL:
+            f->local_read[bc[pc + 1]] = true;
+            pushes = 1;
+            break;
+
+        case OP_DROP:
+            pops = 1;
+            value_used = false;
+            break;
+
+        case OP_SETGLOBAL:
+            pops = 1;
+            break;
+
+        case OP_SETLOCAL:
+            f->local_set[bc[pc + 1]] = true;
+            pops = 1;
+            break;
+
+        case OP_CALLFUNC: {
+            Function const* callee = &funcs[bc[pc + 1]];
+            pops = functions[bc[pc + 1]].argc;
+            pushes = (callee->retc == NO_RETURN) ? 0 : callee->retc;
+            falls_through = (callee->retc != NO_RETURN);
+            break;
+        }
+
+        case OP_RET:
+            pops = bc[pc + 1];
+            falls_through = false;
+
+            if (d != pops) {
+                fail(index, pc, "stack depth at ret does not match the number of return values");
+            }
+            break;
+
+        case OP_JMP:
+            successors[num_successors++] = jump_target(pc);
+            falls_through = false;
+            break;
+
+        case OP_JZ:
+        case OP_JNZ:
+            successors[num_successors++] = jump_target(pc);
+            pops = 1;
+            break;
+
+        case OP_JLT:
+        case OP_JLE:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JGT:
+        case OP_JGE:
+            successors[num_successors++] = jump_target(pc);
+            pops = 2;
+            break;
+
+        case OP_SWITCH:
+            // the first entry of the table is the next instruction
+            for (size_t i = 1; i < switch_entries(&bc[pc]); i++) {
+                successors[num_successors++] = (long) (pc + 2 + 3 * i);
+            }
+            pops = 1;
+            break;
+
+        default:
+            pops = builtins[bc[pc]].argc;
+            pushes = 1;
+        }
+
+        if (d < pops) {
+            fail(index, pc, "stack underflow");
+        }
+
+        for (int i = d - pops; i < d && value_used; i++) {
+            f->slot_read[i] = true;
+        }
+
+        d = d - pops + pushes;
+
+        if (d > f->max_depth) {
+            if (d > 255) {
+                fail(index, pc, "stack too deep");
+            }
+
+            f->max_depth = d;
+        }
+
+        if (falls_through) {
+            successors[num_successors++] = (long) (pc + insn_length(bc[pc]));
+        }
+
+        for (int i = 0; i < num_successors; i++) {
+            long next = successors[i];
+
+            if (next < (long) f->start || next >= (long) f->end) {
+                fail(index, pc, "execution leaves the function");
+            }
+
+            if (f->depth[next - f->start] == NOT_INSN) {
+                fail(index, pc, "jump into the middle of an instruction");
+            }
+            else if (f->depth[next - f->start] == UNREACHED) {
+                f->depth[next - f->start] = d;
+                worklist[num_work++] = next;
+            }
+            else if (f->depth[next - f->start] != d) {
+                fail(index, pc, "stack depth differs between paths that merge");
+            }
+        }
+
+        if (is_jump(bc[pc])) {
+            f->target[successors[0] - f->start] = true;
+        }
+    }
+
+    free(worklist);
+}
+
+// A function may suspend if it can get to a builtin that does, directly or through its callees
+static void find_suspending_functions(void) {
+    bool changed;
+
+    do {
+        changed = false;
+
+        for (size_t i = 0; i < hdr.num_functions; i++) {
+            Function* f = &funcs[i];
+
+            for (size_t pc = f->start; pc < f->end && !f->may_suspend; pc += insn_length(bc[pc])) {
+                if (f->depth[pc - f->start] < 0) {
+                    continue;
+                }
+
+                if (is_suspension_point(bc[pc])
+                        || (bc[pc] == OP_CALLFUNC && funcs[bc[pc + 1]].may_suspend)) {
+                    f->may_suspend = true;
+                    changed = true;
+                }
+            }
+        }
+    } while (changed);
+}
+
+// CODE GENERATION
+
+// store everything that is live at stack depth `depth`, to be picked up again on resuming
+static void put_save(Function const* f, int depth, size_t pc) {
+    for (int i = 0; i < f->frame_base; i++) {
+        if (f->local_read[i] && f->local_set[i]) {
+            put("        fp[%d] = l%d;\n", i, i);
+        }
+    }
+
+    for (int i = 0; i < depth; i++) {
+        if (f->slot_read[i]) {
+            put("        fp[%d] = s%d;\n", f->frame_base + i, i);
+        }
+    }
+
+    put("        fr->pc = 0x%04X;\n", (unsigned) pc);
+}
+
+static void put_reload(Function const* f, int depth) {
+    for (int i = 0; i < depth; i++) {
+        if (f->slot_read[i]) {
+            put("s%d = fp[%d]; ", i, f->frame_base + i);
+        }
+    }
+}
+
+// frame offset and stack depth at which the callee of a call starts
+static int call_base(Function const* f, size_t pc) {
+    return f->depth[pc - f->start] - functions[bc[pc + 1]].argc;
+}
+
+static void put_call(size_t index, size_t pc, bool resume) {
+    Function const* f = &funcs[index];
+    int callee = bc[pc + 1];
+    int base = call_base(f, pc);
+
+    put("%s%sf%d(thr, fp + %d, fr + 1, %s);", resume ? "" : "    ",
+        funcs[callee].may_suspend ? "st = " : "", callee, f->frame_base + base,
+        resume ? "true" : "false");
+}
+
+#define COMPARE_JUMP_CASE(opcode, operator, name) \
+    case opcode: \
+        put("    if (s%d " #operator " s%d) goto L%04X;\n", d - 2, d - 1, \
+            (unsigned) jump_target(pc)); \
+        break;
+
+static void translate_insn(size_t index, size_t pc) {
+    Function const* f = &funcs[index];
+    int d = f->depth[pc - f->start];
+    int op = bc[pc];
+    int operand = (insn_length(op) == 2) ? bc[pc + 1] : 0;
+    V value = (insn_length(op) == 3) ? (V) (bc[pc + 1] | bc[pc + 2] << 8) : 0;
+
+    switch (op) {
+    case OP_PUSHCONST:
+    case OP_ZERO:
+        if (f->slot_read[d]) {
+            put("    s%d = %d;\n", d, value);
+        }
+        break;
+
+    case OP_DROP:
+        break;
+
+    case OP_GETGLOBAL:
+        if (f->slot_read[d]) {
+            put("    s%d = globals[%d];\n", d, operand);
+        }
+        break;
+
+    case OP_SETGLOBAL:
+        put("    globals[%d] = s%d;\n", operand, d - 1);
+        break;
+
+    case OP_GETLOCAL:
+        if (f->slot_read[d]) {
+            put("    s%d = l%d;\n", d, operand);
+        }
+        break;
+
+    case OP_SETLOCAL:
+        if (f->local_read[operand]) {
+            put("    l%d = s%d;\n", operand, d - 1);
+        }
+        break;
+
+    case OP_CALLFUNC: {
+        Func const* callee = &functions[operand];
+        int base = call_base(f, pc);
+        int offset = f->frame_base + base;
+
+        put("    if (fr - thr->frames >= thr->max_frames"
+            " || fp + %d > thr->stack + thr->stack_size) {\n",
+            offset + funcs[operand].frame_base + funcs[operand].max_depth);
+        put("        stak2c_stack_overflow();\n");
+        put("    }\n");
+
+        for (int i = 0; i < callee->argc; i++) {
+            put("    fp[%d] = s%d;\n", offset + i, base + i);
+        }
+
+        put_call(index, pc, false);
+        put("\n");
+
+        if (funcs[operand].may_suspend) {
+            put("r%04X:\n", (unsigned) pc);
+            put("    if (st != STAK2C_RETURNED) {\n");
+            put_save(f, base, pc);
+            put("        return st;\n");
+            put("    }\n");
+        }
+
+        for (int i = 0; i < funcs[operand].retc && funcs[operand].retc != NO_RETURN; i++) {
+            if (f->slot_read[base + i]) {
+                put("    s%d = fp[%d];\n", base + i, offset + i);
+            }
+        }
+
+        // nothing follows a call of a function that never returns (it can only suspend), and
+        // the C function must not seem to end without a return value
+        if (funcs[operand].retc == NO_RETURN) {
+            put("    abort();\n");
+        }
+        break;
+    }
+
+    case OP_RET:
+        for (int i = 0; i < operand; i++) {
+            put("    fp[%d] = s%d;\n", i, d - operand + i);
+        }
+
+        put("    return STAK2C_RETURNED;\n");
+        break;
+
+    case OP_JMP:
+        put("    goto L%04X;\n", (unsigned) jump_target(pc));
+        break;
+
+    case OP_JZ:
+        put("    if (s%d == 0) goto L%04X;\n", d - 1, (unsigned) jump_target(pc));
+        break;
+
+    case OP_JNZ:
+        put("    if (s%d != 0) goto L%04X;\n", d - 1, (unsigned) jump_target(pc));
+        break;
+
+    FOR_EACH_COMPARE_JUMP(COMPARE_JUMP_CASE)
+
+    case OP_SWITCH:
+        // straight to the targets of the table's jmps
+        put("    switch ((uint16_t) s%d) {\n", d - 1);
+
+        for (int i = 0; i < operand; i++) {
+            put("    case %d: goto L%04X;\n", i, (unsigned) jump_target(pc + 2 + 3 * i));
+        }
+
+        put("    default: goto L%04X;\n", (unsigned) jump_target(pc + 2 + 3 * operand));
+        put("    }\n");
+        break;
+
+    default: {
+        int base = d - builtins[op].argc;
+
+        if (builtins[op].kind == BIN_OP) {
+            if (f->slot_read[base]) {
+                put("    s%d = s%d %s s%d;\n", base, base, builtins[op].c, base + 1);
+            }
+        }
+        else if (builtins[op].kind == UNARY_OP) {
+            if (f->slot_read[base]) {
+                put("    s%d = %ss%d;\n", base, builtins[op].c, base);
+            }
+        }
+        else {
+            if (f->slot_read[base]) {
+                put("    s%d = %s(thr", base, builtins[op].c);
+            }
+            else {
+                put("    %s(thr", builtins[op].c);
+            }
+
+            for (int i = 0; i < builtins[op].argc; i++) {
+                put(", s%d", base + i);
+            }
+
+            put(");\n");
+
+            if (is_suspension_point(op)) {
+                put("    if (thr->state != THREAD_EXECUTING) {\n");
+                put_save(f, base + 1, pc);
+                put("        return STAK2C_SUSPENDED;\n");
+                put("    }\n");
+                put("r%04X:;\n", (unsigned) pc);
+            }
+        }
+    }
+    }
+}
+
+static void translate_function(size_t index) {
+    Function const* f = &funcs[index];
+    Func const* func = &functions[index];
+    bool any_locals = false, any_slots = false, any_calls = false, any_resume = false;
+
+    for (size_t pc = f->start; pc < f->end; pc += insn_length(bc[pc])) {
+        if (f->depth[pc - f->start] < 0) {
+            continue;
+        }
+
+        if (bc[pc] == OP_CALLFUNC && funcs[bc[pc + 1]].may_suspend) {
+            any_calls = true;
+            any_resume = true;
+        }
+        else if (is_suspension_point(bc[pc])) {
+            any_resume = true;
+        }
+    }
+
+    put("\n// function %u: %d argument(s), %d local(s), %d max. stack depth\n", (unsigned) index,
+        func->argc, func->num_locals, f->max_depth);
+    put("static int f%u(Thread* thr, V* fp, Frame* fr, bool resume) {\n", (unsigned) index);
+
+    for (int i = 0; i < f->frame_base; i++) {
+        if (f->local_read[i]) {
+            put(any_locals ? ", l%d = fp[%d]" : "    V l%d = fp[%d]", i, i);
+            any_locals = true;
+        }
+    }
+
+    if (any_locals) {
+        put(";\n");
+    }
+
+    for (int i = 0; i < f->max_depth; i++) {
+        if (f->slot_read[i]) {
+            put(any_slots ? ", s%d" : "    V s%d", i);
+            any_slots = true;
+        }
+    }
+
+    if (any_slots) {
+        put(";\n");
+    }
+
+    if (any_calls) {
+        put("    int st;\n");
+    }
+
+    if (any_resume) {
+        put("\n");
+        put("    if (resume) {\n");
+        put("        switch (fr->pc) {\n");
+
+        for (size_t pc = f->start; pc < f->end; pc += insn_length(bc[pc])) {
+            int d = f->depth[pc - f->start];
+
+            if (d < 0) {
+                continue;
+            }
+
+            if (bc[pc] == OP_CALLFUNC && funcs[bc[pc + 1]].may_suspend) {
+                put("        case 0x%04X: ", (unsigned) pc);
+                put_reload(f, call_base(f, pc));
+                put_call(index, pc, true);
+                put(" goto r%04X;\n", (unsigned) pc);
+            }
+            else if (is_suspension_point(bc[pc])) {
+                put("        case 0x%04X: ", (unsigned) pc);
+                put_reload(f, d - builtins[bc[pc]].argc + 1);
+                put("goto r%04X;\n", (unsigned) pc);
+            }
+        }
+
+        put("        }\n");
+        put("    }\n");
+    }
+
+    put("\n");
+
+    for (size_t pc = f->start; pc < f->end; pc += insn_length(bc[pc])) {
+        if (f->depth[pc - f->start] < 0) {
+            continue;
+        }
+
+        if (f->target[pc - f->start]) {
+            put("L%04X:\n", (unsigned) pc);
+        }
+
+        translate_insn(index, pc);
+    }
+
+    put("}\n");
+}
+
+static void translate(char const* bc_filename) {
+    put("// Translated by stak2c from %s. Build with stak2c-main.c and a peripheral backend.\n\n",
+        bc_filename);
+    put("#include \"periph.h\"\n");
+    put("#include \"stak2c.h\"\n");
+
+    if (hdr.num_globals) {
+        put("\nstatic V globals[%u] = {", (unsigned) hdr.num_globals);
+
+        for (size_t i = 0; i < hdr.num_globals; i++) {
+            put(i % 16 ? " %d," : "\n    %d,", globals[i]);
+        }
+
+        put("\n};\n");
+    }
+
+    put("\n");
+
+    for (size_t i = 0; i < hdr.num_functions; i++) {
+        put("static int f%u(Thread* thr, V* fp, Frame* fr, bool resume);\n", (unsigned) i);
+    }
+
+    for (size_t i = 0; i < hdr.num_functions; i++) {
+        translate_function(i);
+    }
+
+    put("\nFunc const stak2c_functions[] = {\n");
+
+    for (size_t i = 0; i < hdr.num_functions; i++) {
+        Func const* func = &functions[i];
+        put("    {%u, %u, 0x%04X, %u, %u, 0},\n", func->argc, func->num_locals,
+            func->bytecode_offset, func->stack_size, func->call_depth);
+    }
+
+    put("};\n");
+    put("\nuint16_t const stak2c_stack_needed[] = {");
+
+    for (size_t i = 0; i < hdr.num_functions; i++) {
+        put(" %d,", funcs[i].frame_base + funcs[i].max_depth);
+    }
+
+    put(" };\n");
+    put("\nTranslatedFunction const stak2c_code[] = {");
+
+    for (size_t i = 0; i < hdr.num_functions; i++) {
+        put(" f%u,", (unsigned) i);
+    }
+
+    put(" };\n");
+    put("\nsize_t const stak2c_num_functions = %u;\n", (unsigned) hdr.num_functions);
+    put("int const stak2c_main_function = %u;\n", (unsigned) hdr.main_func_idx);
+}
+
+void usage_exit(void) {
+    fprintf(stderr, "usage: stak2c <program.bc> [-o <program.c>]\n");
+    exit(-1);
+}
+
+int main(int argc, char** argv) {
+    char const* output_filename = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_filename = argv[++i];
+        }
+        else {
+            if (filename) {
+                usage_exit();
+            }
+
+            filename = argv[i];
+        }
+    }
+
+    if (!filename) {
+        usage_exit();
+    }
+
+    FILE* f = fopen(filename, "rb");
+
+    if (!f) {
+        perror("fopen");
+        return -1;
+    }
+
+    static uint8_t buf[0x8000];
+    size_t size = 0;
+
+    if (fread(&hdr, 1, sizeof(hdr), f) == sizeof(hdr)) {
+        size = fread(buf, 1, sizeof(buf), f);
+    }
+
+    fclose(f);
+
+    size_t globals_offset = hdr.num_functions * sizeof(Func);
+    size_t bytecode_offset = globals_offset + hdr.num_globals * sizeof(V);
+
+    if (bytecode_offset + hdr.bytecode_length > size) {
+        fprintf(stderr, "%s: file is truncated\n", filename);
+        return -1;
+    }
+
+    if (hdr.main_func_idx >= hdr.num_functions) {
+        fprintf(stderr, "%s: no main function\n", filename);
+        return -1;
+    }
+
+    functions = (Func const*) buf;
+    globals = (V const*) (buf + globals_offset);
+    bc = buf + bytecode_offset;
+    funcs = alloc(hdr.num_functions * sizeof(Function));
+
+    // return counts first, they are needed to follow the stack through calls
+    for (size_t i = 0; i < hdr.num_functions; i++) {
+        scan(i);
+    }
+
+    for (size_t i = 0; i < hdr.num_functions; i++) {
+        analyze(i);
+    }
+
+    find_suspending_functions();
+
+    out = output_filename ? fopen(output_filename, "w") : stdout;
+
+    if (!out) {
+        perror("fopen");
+        return -1;
+    }
+
+    translate(filename);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+// Interface between a program translated to C by stak2c and the runtime it is linked with
+// (stak2c-main.c)
+
+#include "stak-vm.h"
+
+enum {
+    STAK2C_RETURNED,
+    STAK2C_SUSPENDED,           // by a builtin, such as pause-frames
+};
+
+// A translated function. fp points to its first argument on the thread's operand stack, which is
+// also where it leaves its return values. On suspending, every active call stores its local
+// values above its fp and its resume point (the bytecode offset) in its Frame `fr`; the callee of
+// a call uses fr + 1. Called with `resume` set, the function picks up from that point.
+typedef int (*TranslatedFunction)(Thread* thr, V* fp, Frame* fr, bool resume);
+
+// generated by stak2c
+extern Func const stak2c_functions[];           // function table of the bytecode module
+extern uint16_t const stak2c_stack_needed[];    // per function: argc + num_locals + max. depth
+extern TranslatedFunction const stak2c_code[];
+extern size_t const stak2c_num_functions;
+extern int const stak2c_main_function;
+
+// provided by the runtime
+void stak2c_stack_overflow(void);
+int pause_frames(Thread* thr, int count);